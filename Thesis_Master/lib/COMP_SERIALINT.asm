@@ -143,6 +143,9 @@ _COMP_SERIAL_RX_ISR:
    ;   NOTE: interrupt service routines must preserve
    ;   the values of the A and X CPU registers.
 
+   ; The PC receive routine lives in main.c so that emergency stops are seen immediately.
+   ljmp _PC_RX_ISR
+
    ;---------------------------------------------------
    ; Insert your custom code above this banner
    ;---------------------------------------------------
@@ -62,11 +62,54 @@ AREA InterruptRAM(RAM,REL,CON)
 ;------------------------
 ;  Constant Definitions
 ;------------------------
+RING_MASK:      equ 1Fh       ; Wraps a ring index. Must match RING_SIZE in main.c.
+PORT_INDEX:     equ 0         ; This port's index in the filter tables.
+PORT_TAG:       equ '1'       ; The tag on bytes from port index 0, PORT_1 in main.c.
+
+; These must match the defines of the same names in main.c.
+START_TRANSMIT: equ 252       ; Starts a transmission.
+END_TRANSMIT:   equ 253       ; Ends a transmission.
+PARENT_ID:      equ 0         ; Our ID.
+BROADCAST:      equ 254       ; The ID that every module answers to.
+FILTER_PASS:    equ 0         ; Passing bytes through between transmissions.
+FILTER_START:   equ 1         ; Read a start byte, waiting for the source.
+FILTER_DESTINATION: equ 2     ; Holding the source until the destination.
+FILTER_OURS:    equ 3         ; Passing a transmission for us through.
+FILTER_DROP:    equ 4         ; Dropping a transmission for someone else.
+FILTER_OFF:     equ 5         ; Not filtering this port at all.
 
 
 ;------------------------
 ; Variable Allocation
 ;------------------------
+; The receive ring that all four ports share, and the ms count its bytes are stamped with.
+; These live here rather than in main.c so that they are in page 0 with the other interrupt
+; variables, where the receive routines can reach them without changing pages.
+export _TIMEOUT
+export _RING_HEAD
+export _RING_TAIL
+export _RING_LOST
+export _RING_PORT
+export _RING_TIME
+export _RING_DATA
+export _FILTER_STATE
+export _FILTER_SOURCE
+export  RingReceive
+
+_TIMEOUT:       BLK 2         ; The ms count the timeout interrupts in main.c keep.
+_RING_HEAD:     BLK 1         ; The ring index the next received byte goes in.
+_RING_TAIL:     BLK 1         ; The ring index the next byte is read from.
+_RING_LOST:     BLK 1         ; The number of bytes dropped because the ring was full.
+_RING_PORT:     BLK (RING_MASK + 1)   ; The port each received byte came in on.
+_RING_TIME:     BLK (RING_MASK + 1)   ; The ms since the receive window opened when each came in.
+_RING_DATA:     BLK (RING_MASK + 1)   ; The received bytes.
+
+; The address filter that keeps transmissions for other modules out of the ring, one state per
+; port. main.c sets the states when a receive window opens.
+_FILTER_STATE:  BLK 4         ; The state of the filter on each port.
+_FILTER_SOURCE: BLK 4         ; The source byte each port's filter is holding.
+RING_BYTE:      BLK 1         ; The byte RingReceive is working on.
+RING_INDEX:     BLK 1         ; The port index of that byte.
 
 
 ;---------------------------------------------------
@@ -94,6 +137,144 @@ _RECEIVE_1_ISR:
    ;   NOTE: interrupt service routines must preserve
    ;   the values of the A and X CPU registers.
 
+   ; Every port feeds the one receive ring that main.c reads, through the filter in RingReceive.
+   push A
+   push X
+
+   mov  A,REG[RECEIVE_1_CONTROL_REG]                       ; Read the status once to clear it
+   mov  X,A                                                ; Keep a copy for the error test
+   and  A,RECEIVE_1_RX_REG_FULL                            ; Did a byte really come in?
+   jz   .RING_DONE                                         ; No, all done
+   mov  A,X
+   and  A,RECEIVE_1_RX_ERROR                               ; Check for a bad byte
+   jnz  .RING_ERROR
+
+   mov  A,REG[RECEIVE_1_RX_BUFFER_REG]                     ; A <- the byte
+   mov  X,PORT_INDEX                                       ; X <- the port it came in on
+   lcall RingReceive
+   jmp  .RING_DONE
+
+.RING_ERROR:
+   tst  REG[RECEIVE_1_RX_BUFFER_REG],00h                   ; Read the byte to clear it
+   and  A,RECEIVE_1_RX_FRAMING_ERROR                       ; Check for framing error special case
+   jz   .RING_DONE
+   and  REG[RECEIVE_1_CONTROL_REG],~RECEIVE_1_RX_ENABLE    ; Disable RX
+   or   REG[RECEIVE_1_CONTROL_REG], RECEIVE_1_RX_ENABLE    ; Enable RX
+
+.RING_DONE:
+   pop  X
+   pop  A
+   reti
+
+;-----------------------------------------------------------------------------
+;  FUNCTION NAME: RingReceive
+;
+;  DESCRIPTION: Runs a received byte through its port's address filter and puts
+;     it in the receive ring if it gets through. The filter drops transmissions
+;     for other modules before they take up ring space. A start byte goes in
+;     right away, the source is held until the destination shows up, and the
+;     two go in together if the transmission is for us or for everyone.
+;     Otherwise everything up to the end byte is dropped. Bytes outside of
+;     transmissions, like servo replies, go in. Ports whose state is FILTER_OFF
+;     put every byte in. Called from the receive interrupts only.
+;
+;  ARGUMENTS:   A = the byte, X = the port index (0 to 3)
+;  RETURNS:     none
+;  SIDE EFFECTS: A and X are not preserved.
+;-----------------------------------------------------------------------------
+RingReceive:
+   mov  [RING_BYTE],A                                      ; Keep the byte and port while A and X work
+   mov  [RING_INDEX],X
+   mov  A,[X+_FILTER_STATE]
+   cmp  A,FILTER_OFF
+   jz   .PUT                                               ; Not filtered, so everything goes in
+   cmp  [RING_BYTE],START_TRANSMIT
+   jz   .START                                             ; A start byte always starts over
+   cmp  A,FILTER_PASS
+   jz   .PUT                                               ; Outside of a transmission
+   cmp  A,FILTER_START
+   jz   .SOURCE
+   cmp  A,FILTER_DESTINATION
+   jz   .DESTINATION
+   cmp  [RING_BYTE],END_TRANSMIT                           ; Ours or dropped, both end on the end byte
+   jnz  .KEEP
+   mov  [X+_FILTER_STATE],FILTER_PASS
+   cmp  A,FILTER_OURS
+   jz   .PUT
+   ret
+
+.KEEP:
+   cmp  A,FILTER_OURS
+   jz   .PUT
+   ret                                                     ; Dropped
+
+.START:
+   mov  [X+_FILTER_STATE],FILTER_START
+   jmp  .PUT
+
+.SOURCE:
+   mov  A,[RING_BYTE]
+   mov  [X+_FILTER_SOURCE],A                               ; Hold the source for now
+   mov  [X+_FILTER_STATE],FILTER_DESTINATION
+   ret
+
+.DESTINATION:
+   cmp  [RING_BYTE],PARENT_ID
+   jz   .OURS
+   cmp  [RING_BYTE],BROADCAST
+   jz   .OURS
+   mov  [X+_FILTER_STATE],FILTER_DROP
+   ret
+
+.OURS:
+   mov  [X+_FILTER_STATE],FILTER_OURS
+   mov  A,[X+_FILTER_SOURCE]
+   call RingPut                                            ; The held source goes in first
+.PUT:
+   mov  A,[RING_BYTE]
+   ; Fall through to RingPut
+
+;-----------------------------------------------------------------------------
+;  FUNCTION NAME: RingPut
+;
+;  DESCRIPTION: Puts a byte in the receive ring, tagged with the port in
+;     RING_INDEX and the low byte of TIMEOUT, or counts it as lost if the ring
+;     is full. The ring lives in page 0, so no page changes are needed.
+;
+;  ARGUMENTS:   A = the byte
+;  RETURNS:     none
+;  SIDE EFFECTS: A and X are not preserved.
+;-----------------------------------------------------------------------------
+RingPut:
+   push A                                                  ; Keep the byte while the slot is found
+   mov  X,[_RING_HEAD]                                     ; X <- the slot this byte goes in
+   mov  A,X
+   inc  A
+   and  A,RING_MASK                                        ; A <- where the head goes next
+   cmp  A,[_RING_TAIL]                                     ; Is the ring full?
+   jz   .FULL
+
+   pop  A
+   mov  [X+_RING_DATA],A                                   ; Store the byte itself
+   mov  A,[RING_INDEX]
+   add  A,PORT_TAG
+   mov  [X+_RING_PORT],A                                   ; Tag the byte with its port
+   mov  A,[_TIMEOUT+1]
+   mov  [X+_RING_TIME],A                                   ; Stamp it with the ms since the window opened
+   mov  A,X
+   inc  A
+   and  A,RING_MASK
+   mov  [_RING_HEAD],A                                     ; Only now hand the slot to the reader
+   ret
+
+.FULL:
+   pop  A
+   cmp  [_RING_LOST],FFh                                   ; Count it as lost, up to 255
+   jz   .DONE
+   inc  [_RING_LOST]
+.DONE:
+   ret
+
    ;---------------------------------------------------
    ; Insert your custom code above this banner
    ;---------------------------------------------------
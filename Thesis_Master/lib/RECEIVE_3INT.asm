@@ -62,6 +62,7 @@ AREA InterruptRAM(RAM,REL,CON)
 ;------------------------
 ;  Constant Definitions
 ;------------------------
+PORT_INDEX:     equ 2         ; This port's index in the filter tables, for RingReceive.
 
 
 ;------------------------
@@ -94,6 +95,35 @@ _RECEIVE_3_ISR:
    ;   NOTE: interrupt service routines must preserve
    ;   the values of the A and X CPU registers.
 
+   ; Every port feeds the one receive ring that main.c reads, through the filter in RingReceive.
+   push A
+   push X
+
+   mov  A,REG[RECEIVE_3_CONTROL_REG]                       ; Read the status once to clear it
+   mov  X,A                                                ; Keep a copy for the error test
+   and  A,RECEIVE_3_RX_REG_FULL                            ; Did a byte really come in?
+   jz   .RING_DONE                                         ; No, all done
+   mov  A,X
+   and  A,RECEIVE_3_RX_ERROR                               ; Check for a bad byte
+   jnz  .RING_ERROR
+
+   mov  A,REG[RECEIVE_3_RX_BUFFER_REG]                     ; A <- the byte
+   mov  X,PORT_INDEX                                       ; X <- the port it came in on
+   lcall RingReceive
+   jmp  .RING_DONE
+
+.RING_ERROR:
+   tst  REG[RECEIVE_3_RX_BUFFER_REG],00h                   ; Read the byte to clear it
+   and  A,RECEIVE_3_RX_FRAMING_ERROR                       ; Check for framing error special case
+   jz   .RING_DONE
+   and  REG[RECEIVE_3_CONTROL_REG],~RECEIVE_3_RX_ENABLE    ; Disable RX
+   or   REG[RECEIVE_3_CONTROL_REG], RECEIVE_3_RX_ENABLE    ; Enable RX
+
+.RING_DONE:
+   pop  X
+   pop  A
+   reti
+
    ;---------------------------------------------------
    ; Insert your custom code above this banner
    ;---------------------------------------------------
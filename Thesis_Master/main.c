@@ -22,6 +22,7 @@
 #include "PSoCAPI.h"    	// PSoC API definitions for all User Modules.
 #include "psocdynamic.h"	// Required for dynamically swapping configurations at run time.
 #include <stdlib.h>			// Required for converting character arrays to and from floats and ints.
+#include <flashblock.h>		// Required for saving the module table to flash.
 
 //#include <string.h>
 
@@ -29,6 +30,33 @@
 #pragma interrupt_handler TX_TIMEOUT_ISR
 #pragma interrupt_handler RX_TIMEOUT_ISR
 
+// This is the PC receive interrupt, which the COMP_SERIAL RX interrupt jumps to.
+#pragma interrupt_handler PC_RX_ISR
+
+// These switches pick which of the optional features are built in. All of them together are about
+// twice what the 16 KB of flash can hold, and with every one of them off there is only a few
+// hundred bytes to spare, so they are all left out. Set a switch to 1 to build its feature in,
+// and turn another one off to make room for it. The map file says how full the ROM is.
+#define		FEATURE_BRIDGE				(0)		// B; passes raw servo packets through from the PC.
+#define		FEATURE_SNIFFER				(0)		// M; sends the PC a timed capture of the bus.
+#define		FEATURE_BULK				(0)		// U; streams large payloads to the modules.
+#define		FEATURE_TIME				(0)		// C; syncs the module clocks and times commands.
+#define		FEATURE_EVENTS				(0)		// Lets modules report events in their own slots.
+#define		FEATURE_GROUPS				(0)		// G; and W,G; write to a group of servos at once.
+#define		FEATURE_DUAL_WRITE			(0)		// D; writes to two servos at once.
+#define		FEATURE_TOPOLOGY_CACHE		(0)		// Saves the module table in flash for the next start up.
+#define		FEATURE_HEARTBEAT			(0)		// Looks for added and removed modules while the PC is quiet.
+#define		FEATURE_PIPELINE			(0)		// Reads the module types a window of pings at a time.
+#define		FEATURE_SWEEP				(0)		// Checks every module that can answer sweeps with one ping.
+#define		FEATURE_ENUMERATE			(0)		// Numbers a whole chain with one packet before trying one at a time.
+#define		FEATURE_FRAMING				(0)		// F; sends module transmissions in CRC-8 frames.
+#define		FEATURE_TOPOLOGY_QUERY		(0)		// T; sends the PC the whole module table.
+
+// Bulk transfers carry any byte value, which only the framing mode can.
+#if FEATURE_BULK && !FEATURE_FRAMING
+#error FEATURE_BULK needs FEATURE_FRAMING
+#endif
+
 // These defines are used as parameters of the configToggle function.
 // Passing one or the other in the function call switches the system between PC and RX modes.
 #define		PC_MODE						(1)
@@ -40,6 +68,12 @@
 #define		PORT_3						('3')
 #define		PORT_4						('4')
 
+// These defines describe the four child ports, which are wired to pins 1 through 4 of port 0.
+#define		NUM_PORTS					(4)				// The number of child ports.
+#define		PORT_PINS					(0b00011110)	// The port 0 pins that lead to the child ports.
+#define		PAIR_14						(0b00010010)	// The port 0 pins that TX_REPEATER_14 drives.
+#define		PAIR_23						(0b00001100)	// The port 0 pins that TX_REPEATER_23 drives.
+
 // This is the module type identifier.
 #define		TYPE						('2')
 
@@ -53,27 +87,167 @@
 #define		PING						(203)	// Indicates that someone is pinging someone else.
 #define		CLEAR_CONFIG				(204)	// Indicates that the parent is asking for a config clear.
 #define		CONFIG_CLEARED				(205)	// Indicates that a module has cleared its own config.
+#define		ENUMERATE					(206)	// Indicates a numbering pass down the whole chain.
+#define		PING_SWEEP					(207)	// Indicates a ping that every module answers in its own slot.
+#define		CAPABILITIES				(208)	// Indicates a request for, or reply with, a capability descriptor.
+#define		BULK_DATA					(209)	// Indicates a chunk of a bulk transfer.
+#define		BULK_ACK					(210)	// Indicates which chunks of a bulk transfer have arrived.
+#define		BULK_END					(211)	// Indicates the end of a bulk transfer.
+#define		TIME_SYNC					(212)	// Indicates a clock reset, with the first ID and hop delay of each port.
+#define		TIME_ARM					(213)	// Indicates that the next command is to be run at a given tick.
+#define		EVENT_WINDOW				(214)	// Indicates a gap in which modules can report events in their slots.
+#define		EVENT						(215)	// Indicates an event report, with the event code and a value.
+
+// These are the feature bits of a module's capability descriptor.
+#define		CAP_FRAMING					(0x01)	// Understands the CRC framing mode.
+#define		CAP_SWEEP					(0x02)	// Answers ping sweeps in its slot.
+#define		CAP_SEQUENCE				(0x04)	// Echoes request sequence numbers.
+#define		CAP_BULK					(0x08)	// Takes part in bulk transfers.
+#define		CAP_EVENTS					(0x10)	// Reports events when the master opens an event window.
 #define		PARENT_ID					(0)		// The parent node's ID.
 #define		BROADCAST					(254)	// The broadcast ID for talking to all nodes.
 #define		BLANK_MODULE_ID				(251)	// This is the ID of an unconfigured module.
 #define		SERVO_START					(255)	// The start byte of a servo.
 
+// These defines are used by the CRC framing mode for module transmissions.
+#define		FRAME_FLAG					(0x7E)	// Starts and ends a framed transmission.
+#define		FRAME_ESCAPE				(0x7D)	// Marks a stuffed byte inside a frame.
+#define		FRAME_XOR					(0x20)	// A stuffed byte is sent XORed with this value.
+#define		FRAME_OVERHEAD				(5)		// Source, destination, type, length and CRC bytes.
+#define		FRAME_MAX_PARAMS			(8)		// The most parameters a frame can carry.
+#define		CRC8_POLY					(0x07)	// The CRC-8 polynomial, x^8 + x^2 + x + 1.
+
+// These defines are the states of the transmission parser.
+#define		PARSE_IDLE					(0)		// Waiting for a start byte.
+#define		PARSE_START					(1)		// Read a start byte, waiting for the source.
+#define		PARSE_DESTINATION			(2)		// Waiting for the destination.
+#define		PARSE_TYPE					(3)		// Waiting for the command type.
+#define		PARSE_PARAM					(4)		// Reading parameters until the end byte.
+#define		PARAM_SIZE					(10)	// The size of the PARAM array.
+#define		PARSE_HEADER				(4)		// The source, destination, type and frame length in front of the parameters in a parse buffer.
+
 // These defines are used to fill in the instruction we are using on the servo.
 #define		PING_SERVO					(1)		// This is the instruction number for ping.
 #define		READ_SERVO					(2)		// This is the instruction number for a read.
 #define		WRITE_SERVO					(3)		// This is the instruction number for a write.
 #define		RESET_SERVO					(6)		// This is the instruction to reset the servo EEPROM.
+#define		SYNC_WRITE_SERVO			(131)	// This is the instruction to write to many servos at once.
+
+// These defines are used for the servo groups managed by the parent.
+#define		NUM_GROUPS					(4)		// The number of servo groups.
+#define		GROUP_BYTES					(TABLE_BYTES)	// The size of a group's member bitmap.
 
 // These defines are used for transmission timing.
 #define 	RX_TIMEOUT_DURATION			(5)		// This is receive wait time in 1 ms units.
+#define		ENUM_TIMEOUT_DURATION		(100)	// This is the chain numbering wait time in 1 ms units.
+#define		RX_WINDOW_MIN				(1)		// This is the shortest learned receive window in 1 ms units.
+#define		RX_WINDOW_MAX				(20)	// This is the longest learned receive window in 1 ms units.
+#define		RTT_SCALE					(8)		// Round trip times are kept in 1/RTT_SCALE ms units.
 
 // These defines are used for the initial probing stage.
 #define		INIT_WAIT_TIME				(50)	// Initial wait time between module probes.
 #define		MAX_TIMEOUTS				(50)	// Number of timeouts allowed before hello mode exit.
+#define		MAX_INIT_WAITS				(5)		// Number of waits for a port's first module before moving on.
 
 // This is the maximum number of allowable modules per branch out from the parent.
 #define		MAX_MODULES					(250)
 
+// These defines are used for segmented addressing, where each port is its own segment and IDs
+// start over at 1 on each one. A module's address is its segment in the high byte and the ID it
+// answers to in the low byte, so the first segment's addresses are the same as plain IDs.
+#define		ADDRESS_FLAT				(1)		// One ID space shared by every port.
+#define		ADDRESS_SEGMENTED			(2)		// One ID space per port.
+#define		SEGMENT_SHIFT				(8)		// The segment is kept above this many bits of the address.
+
+// This is the number of modules that the parent keeps a table entry for.
+#define		TABLE_MODULES				(30)
+#define		TABLE_BYTES					((TABLE_MODULES + 7)/8)	// The size of a bitmap with one bit per table entry.
+
+// This is the width of each module's answer slot in a ping sweep, in 1 ms units.
+#define		SWEEP_SLOT					(1)
+
+// This is the most requests that can be waiting on replies at once.
+#define		PIPE_WINDOW					(4)
+
+// These are the sequence numbers that are legal parameters in the original format.
+#define		PIPE_SEQ_FIRST				(1)
+#define		PIPE_SEQ_LAST				(199)
+
+// These defines are used for bulk transfers.
+#define		BULK_CHUNK					(FRAME_MAX_PARAMS - 1)	// Data bytes per chunk, after the sequence number.
+#define		BULK_WINDOW					(4)		// The most chunks that can be waiting on acknowledgement.
+#define		BULK_RETRIES				(10)	// Rounds without progress before a transfer is given up on.
+
+// This is the latest tick a command can be scheduled for, in 1 ms units. Ticks are sent as two
+// 7 bit halves so that they can never look like start or end bytes.
+#define		TICK_MAX					(16383)
+
+// Every clock parameter is sent plus TIME_OFFSET, since a 0 parameter means no data. In the original
+// format none of them can go past TIME_PARAM_MAX once it is added.
+#define		TIME_OFFSET					(1)
+#define		TIME_PARAM_MAX				(199)
+
+// These defines are used for saving the module table to flash. The table block is the last block of
+// flash, which is left unprotected in flashsecurity.txt so it can be written at run time. The
+// linker is kept out of it by LASTROM in project.mk and -blit in linkfile, which end at 0x3FBF.
+#define		TOPOLOGY_BLOCK				(255)	// The flash block that holds the module table.
+#define		FLASH_BLOCK_SIZE			(64)	// The number of bytes in a flash block.
+#define		FLASH_TEMPERATURE			(25)	// The die temperature used to time flash writes.
+#define		TOPOLOGY_MAGIC				(0x5C)	// Marks a flash block that holds a module table.
+#define		TOPOLOGY_HEADER				(11)	// Magic, addressing, checksum and the port table.
+#define		TOPOLOGY_CHILDREN			(TOPOLOGY_HEADER + TABLE_MODULES)	// Child ports, packed two per byte.
+#define		TOPOLOGY_CAPS				(TOPOLOGY_CHILDREN + (TABLE_MODULES + 1)/2)	// The features of each branch.
+
+// These defines are used for background work while the PC is quiet.
+#define		PROBE_INTERVAL				(1000)	// The ms the PC has to be quiet between background bus checks.
+#define		NOTIFY_ADDED				('+')	// Starts the PC notice that a module was added.
+#define		NOTIFY_REMOVED				('-')	// Starts the PC notice that modules were removed.
+#define		NOTIFY_EVENT				('E')	// Starts the PC notice that a module reported an event.
+
+// These defines are the steps of discovery, which runs a step at a time between PC commands.
+#define		DISCOVER_IDLE				(0)		// Discovery is done, or hasn't been asked for.
+#define		DISCOVER_START				(1)		// Load the saved table, or get ready to search.
+#define		DISCOVER_PORTS				(2)		// Search the ports, one per step.
+#define		DISCOVER_TYPES				(3)		// Read the types and features of what was found.
+#define		DISCOVER_GAP				(20)	// The ms we listen to the PC between discovery steps.
+
+// These defines are used for event reports.
+#define		EVENT_INTERVAL				(100)	// The ms the PC has to be quiet between event windows.
+#define		EVENT_SLOTS					(4)		// The number of events that can wait to go to the PC.
+#define		EVENT_OVERLOAD				(1)		// A servo is overloaded. The value is the servo ID.
+#define		EVENT_OVERHEAT				(2)		// A servo is too hot. The value is the servo ID.
+#define		EVENT_PLUGGED				(3)		// Something was plugged into a port. The value is the port.
+
+// These defines are used by the PC receive interrupt in place of the COMP_SERIAL command buffer.
+#define		PC_BUFFER_SIZE				(64)	// The size of the COMP_SERIAL command buffer.
+#define		PC_CMD_TERM					(';')	// The byte that ends a PC command.
+#define		PC_IGNORE_BELOW				(0x20)	// Bytes below this value are dropped from PC commands.
+#define		PC_RX_ENABLE				(0x01)	// The enable bit of the COMP_SERIAL receiver control register.
+#define		ESTOP_BYTE					('!')	// The emergency stop byte, acted on as it arrives.
+
+// These defines are used by the child port receive interrupts in place of the RECEIVE_n buffers.
+#define		RING_SIZE					(32)	// The number of received bytes the ring can hold. Must match RECEIVE_1INT.asm.
+#define		RING_MASK					(RING_SIZE - 1)	// Wraps a ring index. RING_SIZE must be a power of two.
+
+// These defines are the states of the receive interrupt address filter on each port. They must
+// match RECEIVE_1INT.asm.
+#define		FILTER_PASS					(0)		// Passing bytes through between transmissions.
+#define		FILTER_START				(1)		// Read a start byte, waiting for the source.
+#define		FILTER_DESTINATION			(2)		// Holding the source until the destination.
+#define		FILTER_OURS					(3)		// Passing a transmission for us through.
+#define		FILTER_DROP					(4)		// Dropping a transmission for someone else.
+#define		FILTER_OFF					(5)		// Not filtering the port at all.
+
+// These defines are used by the bus sniffer.
+#define		SNIFF_BUFFER_SIZE			(32)	// The number of bus bytes held between flushes to the PC.
+#define		SNIFF_FRAME					('~')	// The byte that starts a capture frame sent to the PC.
+#define		SNIFF_TX					(0x80)	// Direction flag in a capture tag for transmitted bytes.
+
+// These defines are used for the transparent servo bridge mode.
+#define		BRIDGE_ESCAPE				('+')	// The byte that makes up the bridge exit sequence.
+#define		BRIDGE_ESCAPE_COUNT			(3)		// Consecutive escape bytes needed to leave the bridge.
+#define		BRIDGE_BUFFER_SIZE			(32)	// Size of the servo reply buffer used while bridging.
+
 // Receives a mode identifier and toggles to that mode.
 void configToggle(int mode);
 // Pings the index passed to it. Returns 1 on success, 0 on fail.
@@ -87,38 +261,295 @@ void decodeTransmission(void);
 // Sends out a hello message packet.
 void sayHello(void);
 // Servo instruction function that sends read or write commands.
-void servoInstruction(char id, char length, char instruction, char address, char value);
+void servoInstruction(int id, char length, char instruction, char address, char value);
 // Servo instruction function that sends long two-byte write commands.
-void longServoInstruction(char id, char length, char instruction, char address, char value1, char value2);
+void longServoInstruction(int id, char length, char instruction, char address, char value1, char value2);
 // Immediately performs a non-blocking read char operation, and returns 0 upon failure.
 char iReadChar(void);
 // Performs a blocking read char operation.
 char readChar(void);
+// Immediately performs a non-blocking read with the port status in the upper byte.
+int iReadByte(void);
+// Forwards raw servo packets between the PC and the bus until the escape sequence is sent.
+void bridgeMode(void);
+// Broadcasts a torque off to every servo and flags the current transaction as aborted.
+void emergencyStop(void);
+// Sends a command to the modules, framed or not depending on the framing mode.
+void sendCommand(int destination, char type, char count, char param);
+// Sends a byte inside a frame, stuffing it if needed, and returns the updated CRC.
+char framePutChar(char crc, char value);
+// Feeds one byte to a port's transmission parser. Returns 1 when a transmission is complete.
+int parseByte(char port, char value);
+// Feeds one byte to a port's frame parser. Returns 1 when a good frame is complete.
+int frameByte(char port, char value);
+// Hands a complete transmission from a port's parse buffer to the command globals.
+void parseFinish(char port, char count);
+// Starts every port's parser over.
+void parseReset(void);
+// Folds a byte into a CRC-8.
+char crc8(char crc, char value);
+// Sends a byte out of the repeaters that lead to the routed ports.
+void busPutChar(char value);
+// Waits for the repeaters that lead to the routed ports to finish sending.
+void busWait(void);
+// Finishes the wait for the modules to start listening, if it hasn't finished yet.
+void busSettle(void);
+// Sends two-byte writes to two servos at once, one out of each repeater where possible.
+void dualServoWrite(int id1, char value1_low, char value1_high, int id2, char value2_low, char value2_high, char address);
+// Sends one write to every servo in a group with a single packet.
+void groupWrite(char group, char address, char count, char value1, char value2);
+// Records a bus byte with its direction, port and time if the sniffer is on.
+void sniffByte(char tag, char value, char time);
+// Records the received bytes that the sniffer hasn't seen yet.
+void sniffRing(void);
+// Turns the receive interrupts' address filter on or off for the ports that can be filtered.
+void filterPorts(char on);
+// Sends the captured bus bytes to the PC.
+void sniffFlush(void);
 // Checks the current mode and unloads the configuration for that mode.
 void unloadAllConfigs(void);
 // Unloads the configuration corresponding to the number passed to it.
 void unloadConfig(int config_num);
 // Initialization function for the child module controllers.
 void initializeChildren(void);
+// Takes the next step of discovery.
+void discoverStep(void);
 // Static wait time of approximately 50 microseconds for use after starting a transmission.
 void xmitWait(void);
-// Listen for a child and record the port value.
-void childListen(void);
+// Listen for a child on the current port. Returns 1 if one answered, 0 if not.
+int childListen(void);
+// Finds and numbers the chain of modules on one port.
+void initializePort(char port);
+// Returns the port that leads to a module, or 0 if it isn't in the port table.
+char portOf(int module_id);
+// Returns the number of modules in the port table.
+int moduleCount(void);
+// Returns where a module is in the per-module tables, counting from 1, or 0 if it has no entry.
+int tableEntry(int module_id);
+// Returns the next module in the port table after the one passed, or 0 if there are no more.
+int nextModule(int module_id);
+// Takes a run of modules that were cut off out of the per-module tables.
+void tableRemove(int entry, int count);
+// Sends transmissions out of one port, or all of them if passed 0.
+void routeTo(char port);
+// Points the receiver and the transmit route at the port that leads to a module.
+void selectModule(int module_id);
+// Numbers the whole chain in one pass. Returns the number of modules, or 0 on failure.
+int enumerateChain(void);
+// Sizes the receive window for a module from its measured round trip time.
+void setRxWindow(int module_id);
+// Folds the time since the receive window opened into a module's round trip estimate.
+void measureRTT(int module_id);
+// Pings every module in the table to record its type and child port.
+void readTypes(void);
+// Pings a run of modules back to back and collects the replies in one window. Returns the number that answered.
+int pipelinePing(int first, int count);
+// Sends the cached module table to the PC.
+void sendTopology(void);
+// Asks every module in the table what it can do and works out what each branch can do.
+void readCapabilities(void);
+// Asks one module for its capability descriptor. Returns 1 on success, 0 on fail.
+int queryCapabilities(int module_id);
+// Works out the features, baud rate and buffer size that every module on each branch supports.
+void branchCapabilities(void);
+// Sends a command with any number of parameters, up to FRAME_MAX_PARAMS.
+void sendParams(int destination, char type, char count, char* params);
+// Starts a bulk transfer to a module, or to every module. Returns 1 if it can be done, 0 if not.
+int bulkStart(int destination);
+// Adds bytes to a bulk transfer. Returns 1 if there was room for them, 0 if not.
+int bulkAdd(char* hex);
+// Sends the chunks that haven't been acknowledged and collects the acknowledgements.
+void bulkRound(void);
+// Sends the rest of a bulk transfer and ends it. Returns 1 on success, 0 on fail.
+int bulkFinish(void);
+// Converts a hex digit to its value.
+char hexValue(char digit);
+// Resets the clock of every module, compensated for how far down its branch it is. Returns 1 on success, 0 on fail.
+int timeSync(void);
+// Tells modules to hold their next command until the given tick.
+void timeArm(int destination, int tick);
+// Returns the ID a module answers to on its own segment.
+char wireID(int module_id);
+// Returns the number of slots a ping sweep has to leave room for.
+int sweepSlots(void);
+// Gives every module that reports events a slot to send them in.
+void eventWindow(void);
+// Stores an event report that just came in until it can go to the PC.
+void queueEvent(void);
+// Sends the stored event reports to the PC.
+void sendEvents(void);
+// Saves the module table to flash.
+void saveTopology(void);
+// Loads the module table from flash and checks it against the bus. Returns 1 on success, 0 on fail.
+int loadTopology(void);
+// Looks for a module newly attached to the end of a chain and gives it the next ID.
+void probeTail(void);
+// Finds the first module that stopped answering on each port and cuts the chain off there.
+void checkChain(void);
+// Pings every module at once and records who answered. Returns the number that answered.
+int pingSweep(void);
+// Sweeps the branches that can be swept and pings the rest one at a time. Returns the number that answered.
+int checkLive(void);
+// Returns 1 if a module answered the last ping sweep, 0 if not.
+int isLive(int module_id);
 
-int TIMEOUT;				// This flag is incremented if there is a timeout.
-int NUM_MODULES;			// Stores the number of modules that have been discovered.
+extern int TIMEOUT;			// This flag is incremented if there is a timeout.
+int RX_WINDOW;				// The length of the current receive window in 1 ms units.
+int NUM_MODULES;			// Stores the highest ID in use. Without segmented addressing it is the module count.
 int STATE;					// Stores the current configuration state of the system.
-char CHILD;					// The child port value stored from initialization.
+char CHILD;					// The child port that we are currently listening to.
+char ROUTE;					// The port 0 pins that transmissions currently go out of.
+char ESTOP;					// This flag is set by the PC receive interrupt on an emergency stop.
+char FRAMED;				// This flag is set while module transmissions use CRC framing.
+char RX_FRAMED;				// The ports whose replies are framed, one bit per port index.
+#if FEATURE_FRAMING
+char FRAMING;				// This flag is set if CRC framing should be used where every module supports it.
+#endif
+char SEGMENTED;				// This flag is set if IDs start over at 1 on each port.
+char ADDRESSING;			// The addressing the PC asked for, or 0 to keep what was saved in flash.
+char ROUTE_CAPS;			// The features that every module on the routed ports has.
+char SETTLING;				// This flag is set while the modules may still be switching to listen.
+int IDLE_COUNT;				// Counts the ms in PC mode without a PC command, up to PROBE_INTERVAL.
+#if FEATURE_HEARTBEAT
+char PROBE_TURN;			// Picks which background check runs next.
+char PROBE_PORT;			// The port that the next background tail probe goes out of.
+#endif
+char DISCOVERY;				// The next step of discovery to take.
+char DISCOVER_PORT;			// The port the next discovery step searches, from 0.
+int STEP_IDLE;				// Counts the ms in PC mode since the last discovery step or command.
+
+// The receive ring, its address filter and TIMEOUT are kept in page 0 by RECEIVE_1INT.asm, so that
+// the receive interrupts can store a byte without changing pages.
+extern char RING_PORT[RING_SIZE];	// Stores the port each received byte came in on.
+extern char RING_TIME[RING_SIZE];	// Stores the ms since the receive window opened when each byte came in.
+extern char RING_DATA[RING_SIZE];	// Stores the received bytes.
+extern char RING_HEAD;		// The ring index the next received byte goes in.
+extern char RING_TAIL;		// The ring index the next byte is read from.
+extern char RING_LOST;		// The number of received bytes dropped because the ring was full.
+extern char FILTER_STATE[NUM_PORTS];	// The state of the address filter on each port.
+extern char FILTER_SOURCE[NUM_PORTS];	// The source byte each port's filter is holding.
+char RX_PORT;				// The port that the last byte read came in on.
 
-char COMMAND_SOURCE;		// Stores who the current command is from.
+#if FEATURE_SNIFFER
+char SNIFF;								// This flag is set while the bus sniffer is on.
+char SNIFF_COUNT;						// The number of bytes waiting in the capture log.
+char SNIFF_LOST;						// The number of bytes dropped because the log was full.
+char SNIFF_LOG[SNIFF_BUFFER_SIZE][3];	// Stores the tag, time in ms and value of each byte.
+char RING_SNIFF;						// The ring index of the next byte the sniffer hasn't seen.
+#else
+#define		SNIFF						(0)		// Without the sniffer built in, it is never on.
+#endif
+
+int COMMAND_SOURCE;			// Stores who the current command is from.
 char COMMAND_DESTINATION;	// Stores who the current command is for.
 char COMMAND_TYPE;			// Stores the type of command that was just read.
-char PARAM[10];				// Stores a parameters that accompanies the command (if any).
+char PARAM[PARAM_SIZE];		// Stores a parameters that accompanies the command (if any).
+
+// Every port has its own parser, since the ports can answer at the same time.
+char PARSE_STATE[NUM_PORTS];	// The state of each port's transmission parser.
+char PARSE_COUNT[NUM_PORTS];	// The number of parameter or frame bytes each parser has read.
+#if FEATURE_FRAMING
+char PARSE_CRC[NUM_PORTS];		// The CRC of the frame bytes each parser has read.
+char PARSE_ESCAPE[NUM_PORTS];	// Set if the last frame byte on a port was the escape byte.
+#endif
+char PARSE_BUFFER[NUM_PORTS][PARSE_HEADER + PARAM_SIZE];	// The transmission each parser is reading.
+
+int PORT_FIRST[NUM_PORTS];			// Stores the first ID on each port.
+char PORT_COUNT[NUM_PORTS];			// Stores the number of IDs on each port.
+
+#if FEATURE_GROUPS
+char GROUP[NUM_GROUPS][GROUP_BYTES];	// Stores the members of each servo group, one bit per ID.
+#endif
+char LIVE[TABLE_BYTES];					// Stores which modules answered the last ping sweep, one bit per table entry.
+
+#if FEATURE_PIPELINE
+int PIPE_ID[PIPE_WINDOW];	// Stores the module each outstanding request went to (0 once answered).
+char PIPE_SEQ;				// The sequence number of the next request.
+#endif
+
+#if FEATURE_BULK
+char BULK_BUFFER[BULK_WINDOW][BULK_CHUNK];	// Stores the chunks of a bulk transfer that are in the window.
+char BULK_LENGTH[BULK_WINDOW];	// Stores the number of data bytes in each chunk in the window.
+int BULK_DESTINATION;		// The module a bulk transfer is going to, or BROADCAST.
+char BULK_ACTIVE;			// This flag is set while a bulk transfer that started successfully is open.
+char BULK_BASE;				// The sequence number of the first chunk in the window.
+char BULK_COUNT;			// The number of chunks in the window that are ready to send.
+char BULK_FILL;				// The number of bytes in the chunk being filled after them.
+char BULK_ACKED;			// Stores which chunks in the window have been acknowledged, one bit each.
+char BULK_STALLS;			// The number of rounds in a row that made no progress.
+#endif
+
+#if FEATURE_EVENTS
+int EVENT_IDLE;				// Counts the ms in PC mode without a command or event window, up to EVENT_INTERVAL.
+int EVENT_SOURCE[EVENT_SLOTS];		// Stores who each waiting event is from.
+char EVENT_QUEUE[EVENT_SLOTS][2];	// Stores the code and value of each waiting event.
+char EVENT_COUNT;			// The number of events waiting to go to the PC.
+char EVENT_LOST;			// The number of events dropped because the queue was full.
+#endif
+
+char MODULE_TYPE[TABLE_MODULES];	// Stores the type of each module, indexed by its table entry minus one.
+char MODULE_CHILD[TABLE_MODULES];	// Stores the port each module's child is on (0 if none).
+char MODULE_CAPS[TABLE_MODULES];	// Stores the feature bits of each module (0 if unknown).
+
+char PORT_CAPS[NUM_PORTS];			// Stores the feature bits that every module on each port has.
+char RTT_AVERAGE[TABLE_MODULES];	// Stores the smoothed round trip time of each module (0 if unknown).
+char RTT_DEVIATION[TABLE_MODULES];	// Stores the smoothed round trip time deviation of each module.
 
 void main()
 {	
+#if FEATURE_GROUPS
+	int i = 0;			// An iterator for looping.
+#endif
+	
 	NUM_MODULES = 0;	// Initialize the number of modules.
 	STATE = 0;			// Initialize the current hardware state.
+	ESTOP = 0;			// Initialize the emergency stop flag.
+	FRAMED = 0;			// Start with the original transmission format.
+#if FEATURE_FRAMING
+	FRAMING = 0;		// Start with CRC framing turned off.
+#endif
+	SEGMENTED = 0;		// Start with one ID space until the saved table says otherwise.
+	ADDRESSING = 0;		// Keep whatever addressing was saved in flash.
+	SETTLING = 0;		// Nobody is switching configurations yet.
+#if FEATURE_PIPELINE
+	PIPE_SEQ = PIPE_SEQ_FIRST;	// Start the request sequence numbers over.
+#endif
+#if FEATURE_BULK
+	BULK_ACTIVE = 0;	// No bulk transfer is open yet.
+#endif
+	parseReset();		// Start the parsers out waiting for a transmission.
+	IDLE_COUNT = 0;		// Start the background work count over.
+#if FEATURE_HEARTBEAT
+	PROBE_TURN = 0;		// Start the background checks with the tail probe.
+	PROBE_PORT = 0;		// Start the tail probes on the first port.
+#endif
+	STEP_IDLE = 0;		// Start the discovery gap count over.
+	DISCOVERY = DISCOVER_IDLE;	// Discovery starts as soon as the loop sees there are no modules.
+	ROUTE = PORT_PINS;	// Start out transmitting on every port.
+	RING_HEAD = 0;		// Start with an empty receive ring.
+	RING_TAIL = 0;		// Start with an empty receive ring.
+	RING_LOST = 0;		// Start with no dropped bytes.
+	
+#if FEATURE_SNIFFER
+	SNIFF = 0;			// Start with the bus sniffer off.
+	SNIFF_COUNT = 0;	// Start with an empty capture log.
+	SNIFF_LOST = 0;		// Start with no dropped captures.
+	RING_SNIFF = 0;		// Start with nothing for the sniffer to see.
+#endif
+	
+#if FEATURE_EVENTS
+	EVENT_IDLE = 0;		// Start the event window count over.
+	EVENT_COUNT = 0;	// Start with no events waiting.
+	EVENT_LOST = 0;		// Start with no dropped events.
+#endif
+	
+#if FEATURE_GROUPS
+	// Start with every servo group empty.
+	for(i = 0; i < (NUM_GROUPS * GROUP_BYTES); i++)
+	{
+		GROUP[i / GROUP_BYTES][i % GROUP_BYTES] = 0;
+	}
+#endif
 	
 	// Activate GPIO ISR.
 	M8C_EnableIntMask(INT_MSK0,INT_MSK0_GPIO);
@@ -128,51 +559,125 @@ void main()
 	
 	while(1)
 	{
-		// If there are no modules, find some. Otherwise, look for computer commands.
-		if(!NUM_MODULES)
+		// If an emergency stop came in, the interrupt has already sent a torque off, but it may
+		// have landed in the middle of another packet where the servos missed its start bytes.
+		// Send it again now that nothing else is going out, then let the PC know and stop
+		// dropping servo instructions. A stop that comes in during this sets the flag again.
+		if(ESTOP)
 		{
-			initializeChildren();
+			if(STATE != PC_MODE)
+			{
+				configToggle(PC_MODE);
+			}
+			
+			ESTOP = 0;
+			servoInstruction(BROADCAST,4,WRITE_SERVO,24,0);
+			
+			COMP_SERIAL_PutChar(ESTOP_BYTE);
+			COMP_SERIAL_PutChar('\n');
+		}
+		
+#if FEATURE_EVENTS
+		// Pass along any events that the modules have reported.
+		if(EVENT_COUNT || EVENT_LOST)
+		{
+			sendEvents();
+		}
+		
+#endif
+		// If there are no modules, start finding some.
+		if(!NUM_MODULES && !DISCOVERY)
+		{
+			DISCOVERY = DISCOVER_START;
+		}
+		
+		// The first step is quick and leaves us listening to the PC. After that, computer
+		// commands come first and discovery moves along a step at a time in between them.
+		if(DISCOVERY == DISCOVER_START)
+		{
+			discoverStep();
+			STEP_IDLE = 0;
 		}
 		else if(COMP_SERIAL_bCmdCheck())
 		{
 			decodeTransmission();
+			IDLE_COUNT = 0;
+			STEP_IDLE = 0;
+#if FEATURE_EVENTS
+			EVENT_IDLE = 0;
+#endif
+		}
+		else if(!SETTLING)
+		{
+			// The settle timer also times how long the PC has been quiet, so keep it running
+			// while we wait. The last bus transmission may have stopped it.
+			TIMEOUT = 0;
+			SETTLING = 1;
+			TX_TIMEOUT_Start();
+		}
+		else if(COMP_SERIAL_bRxCnt)
+		{
+			// The PC is partway through a command. The background work unloads the PC UART,
+			// and the rest of the command would be lost, so leave the bus alone until it is in.
+		}
+		else if(DISCOVERY)
+		{
+			// Give the PC a chance to get a command in between steps.
+			if(STEP_IDLE >= DISCOVER_GAP)
+			{
+				discoverStep();
+				STEP_IDLE = 0;
+			}
 		}
+#if FEATURE_EVENTS
+		else if(EVENT_IDLE >= EVENT_INTERVAL)
+		{
+			// The PC has been quiet for a bit, so let the modules speak up.
+			eventWindow();
+			EVENT_IDLE = 0;
+		}
+#endif
+#if FEATURE_HEARTBEAT
+		else if(IDLE_COUNT >= PROBE_INTERVAL)
+		{
+			// The PC has been quiet for a while, so take turns seeing if the robot has grown
+			// and making sure that it hasn't shrunk.
+			if(PROBE_TURN)
+			{
+				checkChain();
+			}
+			else
+			{
+				probeTail();
+			}
+			
+			PROBE_TURN = !PROBE_TURN;
+			IDLE_COUNT = 0;
+		}
+#endif
 	}
 }
 
 int pingModule(int module_id)
 {
+	// Only talk through the port that leads to the module.
+	selectModule(module_id);
+	
 	// Toggle into PC mode.
 	configToggle(PC_MODE);
 	
 	// Transmit a ping to everyone.
-	TX_REPEATER_14_PutChar(START_TRANSMIT);	// Start byte one
-	TX_REPEATER_23_PutChar(START_TRANSMIT);		// Start byte one
-	TX_REPEATER_14_PutChar(START_TRANSMIT);	// Start byte two
-	TX_REPEATER_23_PutChar(START_TRANSMIT);		// Start byte two
-	TX_REPEATER_14_PutChar(PARENT_ID);			// My ID
-	TX_REPEATER_23_PutChar(PARENT_ID);			// My ID
-	TX_REPEATER_14_PutChar(module_id);			// Destination ID
-	TX_REPEATER_23_PutChar(module_id);			// Destination ID
-	TX_REPEATER_14_PutChar(PING);				// This is a ping response
-	TX_REPEATER_23_PutChar(PING);				// This is a ping response
-	TX_REPEATER_14_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_14_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	
-	// Wait for the transmission to finish.
-	while(!(TX_REPEATER_14_bReadTxStatus() & TX_REPEATER_14_TX_COMPLETE));
-	while(!(TX_REPEATER_23_bReadTxStatus() & TX_REPEATER_23_TX_COMPLETE));
+	sendCommand(module_id,PING,0,0);
 	
 	// Make completely sure we're done.
 	xmitWait();
 	
 	// Switch to listening mode.
 	configToggle(RX_MODE);
+	setRxWindow(module_id);
 	
 	// Listen for the response.
-	while(TIMEOUT < RX_TIMEOUT_DURATION)
+	while(TIMEOUT < RX_WINDOW)
 	{
 		if(validTransmission())
 		{
@@ -185,6 +690,8 @@ int pingModule(int module_id)
 					// If it's from the right module, return 1.
 					if(COMMAND_SOURCE == module_id)
 					{
+						measureRTT(module_id);
+						
 						return 1;
 					}
 				}
@@ -203,27 +710,11 @@ int assignID(int assigned_ID)
 	// Switch to PC mode.
 	configToggle(PC_MODE);
 
-	// Transmit an ID assignment.
-	TX_REPEATER_14_PutChar(START_TRANSMIT);	// Start byte one
-	TX_REPEATER_23_PutChar(START_TRANSMIT);		// Start byte one
-	TX_REPEATER_14_PutChar(START_TRANSMIT);	// Start byte two
-	TX_REPEATER_23_PutChar(START_TRANSMIT);		// Start byte two
-	TX_REPEATER_14_PutChar(PARENT_ID);			// My ID
-	TX_REPEATER_23_PutChar(PARENT_ID);			// My ID
-	TX_REPEATER_14_PutChar(BLANK_MODULE_ID);	// Destination ID
-	TX_REPEATER_23_PutChar(BLANK_MODULE_ID);	// Destination ID
-	TX_REPEATER_14_PutChar(ID_ASSIGNMENT);		// This is an ID assignment
-	TX_REPEATER_23_PutChar(ID_ASSIGNMENT);		// This is an ID assignment
-	TX_REPEATER_14_PutChar(assigned_ID);		// This is the new ID
-	TX_REPEATER_23_PutChar(assigned_ID);		// This is the new ID
-	TX_REPEATER_14_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_14_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(END_TRANSMIT);		// This is the end of this transmission
+	// Blank modules only understand the original format.
+	FRAMED = 0;
 	
-	// Wait for the transmission to finish.
-	while(!(TX_REPEATER_14_bReadTxStatus() & TX_REPEATER_14_TX_COMPLETE));
-	while(!(TX_REPEATER_23_bReadTxStatus() & TX_REPEATER_23_TX_COMPLETE));
+	// Transmit an ID assignment.
+	sendCommand(BLANK_MODULE_ID,ID_ASSIGNMENT,1,wireID(assigned_ID));
 	
 	// Make completely sure we're done.
 	xmitWait();
@@ -232,7 +723,7 @@ int assignID(int assigned_ID)
 	configToggle(RX_MODE);
 	
 	// Listen for the response.
-	while(TIMEOUT < RX_TIMEOUT_DURATION)
+	while(TIMEOUT < RX_WINDOW)
 	{
 		if(validTransmission())
 		{
@@ -245,6 +736,8 @@ int assignID(int assigned_ID)
 					// If it is from the right module, return 1.
 					if(COMMAND_SOURCE == assigned_ID)
 					{
+						measureRTT(assigned_ID);
+						
 						return 1;
 					}
 				}
@@ -264,25 +757,12 @@ void sayHello(void)
 	// Toggle into PC mode.
 	configToggle(PC_MODE);
 	
-	// Transmit an ID assignment.
-	TX_REPEATER_14_PutChar(START_TRANSMIT);	// Start byte one
-	TX_REPEATER_23_PutChar(START_TRANSMIT);		// Start byte one
-	TX_REPEATER_14_PutChar(START_TRANSMIT);	// Start byte two
-	TX_REPEATER_23_PutChar(START_TRANSMIT);		// Start byte two
-	TX_REPEATER_14_PutChar(PARENT_ID);			// My ID
-	TX_REPEATER_23_PutChar(PARENT_ID);			// My ID
-	TX_REPEATER_14_PutChar(BLANK_MODULE_ID);	// Destination ID
-	TX_REPEATER_23_PutChar(BLANK_MODULE_ID);	// Destination ID
-	TX_REPEATER_14_PutChar(HELLO_BYTE);		// This is a hello message
-	TX_REPEATER_23_PutChar(HELLO_BYTE);			// This is a hello message
-	TX_REPEATER_14_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_14_PutChar(END_TRANSMIT);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(END_TRANSMIT);		// This is the end of this transmission
+	// Blank modules only understand the original format, so neither the hello nor the answers to
+	// it are framed.
+	FRAMED = 0;
 	
-	// Wait for the transmission to finish.
-	while(!(TX_REPEATER_14_bReadTxStatus() & TX_REPEATER_14_TX_COMPLETE));
-	while(!(TX_REPEATER_23_bReadTxStatus() & TX_REPEATER_23_TX_COMPLETE));
+	// Transmit a hello message.
+	sendCommand(BLANK_MODULE_ID,HELLO_BYTE,0,0);
 	
 	// Make completely sure we're done.
 	xmitWait();
@@ -291,78 +771,247 @@ void sayHello(void)
 	configToggle(RX_MODE);
 }
 
-// This function returns whether or not a valid transmission has been received.
+// This function returns whether or not a valid transmission has been received. Bytes are handed
+// to their port's parser one at a time as they come in, and the parser picks up where it left off
+// on the next call, so nothing is read twice and no byte is waited on. Since each port has its own
+// parser, replies that come in on several ports at once don't get mixed together.
 int validTransmission(void)
 {
-	int i = 0;			// Index for looping.
-	char tempByte = 0;	// Temporary byte storage.
+	int tempByte = 0;	// The byte and its port status.
+	char port = 0;		// The index of the port the byte came in on.
 	
-	// These loops and conditionals are arranged in a way that allows this read
-	// operation to be completely non-blocking.
-	while(TIMEOUT < RX_TIMEOUT_DURATION)
+	while(TIMEOUT < RX_WINDOW)
 	{
-		// Wait until we read a start transmit byte.
-		if(iReadChar() == START_TRANSMIT)
+		// Skip ahead if there is no data.
+		if((tempByte = iReadByte()) & 0xFF00)
+		{
+			continue;
+		}
+		
+		port = RX_PORT - PORT_1;
+		
+#if FEATURE_FRAMING
+		if((RX_FRAMED >> port) & 1)
 		{
-			// While we haven't timed out, look for something other than a start byte.
-			while(TIMEOUT < RX_TIMEOUT_DURATION)
+			if(!frameByte(port, tempByte))
 			{
-				// If we find a nonzero byte...
-				if(tempByte = iReadChar())
-				{
-					// If the byte we found isn't a start byte...
-					if(tempByte != START_TRANSMIT)
-					{
-						// This byte is probably the command source.
-						COMMAND_SOURCE = tempByte;
-						
-						// Look for the rest of the command before we time out.
-						while(TIMEOUT < RX_TIMEOUT_DURATION)
-						{
-							// If we read another nonzero byte...
-							if(tempByte = iReadChar())
-							{
-								// If that byte is in the command type indicator space...
-								if(tempByte >= COMMAND_TYPE_SPACE)
-								{
-									// Store the command type.
-									COMMAND_TYPE = tempByte;
-									
-									// Continue reading if we have not timed out yet.
-									while(TIMEOUT < RX_TIMEOUT_DURATION)
-									{
-										// If we read a nonzero byte...
-										if(tempByte = iReadChar())
-										{
-											// Store the parameter if it is not the end indicator.
-											if(tempByte != END_TRANSMIT)
-											{
-												PARAM[i] = tempByte;
-												i++;
-											}
-											else
-											{
-												return 1;
-											}
-										}
-									}
-								}
-							}
-						}
-					}
-				}
+				continue;
 			}
 		}
+		else
+#endif
+		if(!parseByte(port, tempByte))
+		{
+			continue;
+		}
+		
+		// With segmented addressing, the port the transmission came in on is the sender's segment.
+		if(SEGMENTED && (COMMAND_SOURCE >= 1) && (COMMAND_SOURCE <= MAX_MODULES))
+		{
+			COMMAND_SOURCE |= port << SEGMENT_SHIFT;
+		}
+		
+#if FEATURE_EVENTS
+		// Events can come in with any reply, so store them and keep looking.
+		if((COMMAND_TYPE == EVENT) && (COMMAND_DESTINATION == PARENT_ID))
+		{
+			queueEvent();
+			
+			continue;
+		}
+		
+#endif
+		return 1;
+	}
+	
+	return 0;
+}
+
+// This function moves a port's transmission parser along by one byte. A transmission is two start
+// bytes, the source, the destination, the command type, any parameters and two end bytes. Every
+// byte is one step, and a start byte always starts the parse over, so garbage is dropped as soon
+// as the next transmission begins. Parameters past the end of PARAM throw the transmission out.
+// Returns 1 when the first end byte of a good transmission is read, with the command globals
+// filled in.
+int parseByte(char port, char value)
+{
+	char* buffer = PARSE_BUFFER[port];	// The transmission being read.
+	
+	// A start byte can only begin a transmission.
+	if(value == START_TRANSMIT)
+	{
+		PARSE_STATE[port] = PARSE_START;
+		
+		return 0;
+	}
+	
+	if(PARSE_STATE[port] == PARSE_START)
+	{
+		buffer[0] = value;
+		PARSE_STATE[port] = PARSE_DESTINATION;
+	}
+	else if(PARSE_STATE[port] == PARSE_DESTINATION)
+	{
+		buffer[1] = value;
+		PARSE_STATE[port] = PARSE_TYPE;
+	}
+	else if(PARSE_STATE[port] == PARSE_TYPE)
+	{
+		// Anything outside of the command type space means we lost our place.
+		if((value >= COMMAND_TYPE_SPACE) && (value != END_TRANSMIT))
+		{
+			buffer[2] = value;
+			PARSE_COUNT[port] = 0;
+			PARSE_STATE[port] = PARSE_PARAM;
+		}
+		else
+		{
+			PARSE_STATE[port] = PARSE_IDLE;
+		}
+	}
+	else if(PARSE_STATE[port] == PARSE_PARAM)
+	{
+		if(value == END_TRANSMIT)
+		{
+			PARSE_STATE[port] = PARSE_IDLE;
+			parseFinish(port, PARSE_COUNT[port]);
+			
+			return 1;
+		}
+		else if(PARSE_COUNT[port] < PARAM_SIZE)
+		{
+			buffer[PARSE_HEADER + PARSE_COUNT[port]] = value;
+			PARSE_COUNT[port]++;
+		}
+		else
+		{
+			PARSE_STATE[port] = PARSE_IDLE;
+		}
+	}
+	
+	// Idle bytes, like the second end byte, are ignored.
+	return 0;
+}
+
+#if FEATURE_FRAMING
+// This function moves a port's frame parser along by one byte. A frame is the flag byte, then the
+// source, destination, command type, parameter count, parameters and CRC-8, then the flag byte
+// again. Flag and escape bytes inside the frame are sent as the escape byte followed by the byte
+// XORed with FRAME_XOR, so parameters can take any value. The CRC is worked out as bytes come in,
+// and a frame that fails it, or that is too long, is thrown out at its closing flag. The frame
+// bytes go in the parse buffer in the order they come. Returns 1 when a good frame is complete.
+int frameByte(char port, char value)
+{
+	char* buffer = PARSE_BUFFER[port];	// The frame being read.
+	char count = PARSE_COUNT[port];		// The number of frame bytes read so far.
+	
+	if(value == FRAME_FLAG)
+	{
+		// A CRC-8 run over a frame and its own CRC comes out to zero.
+		if((count >= FRAME_OVERHEAD) && !PARSE_CRC[port] && (buffer[3] <= FRAME_MAX_PARAMS) && (buffer[3] == (count - FRAME_OVERHEAD)))
+		{
+			PARSE_COUNT[port] = 0;
+			parseFinish(port, buffer[3]);
+			
+			return 1;
+		}
+		
+		// Either way, this flag starts the next frame.
+		PARSE_COUNT[port] = 0;
+		PARSE_CRC[port] = 0;
+		PARSE_ESCAPE[port] = 0;
+		
+		return 0;
+	}
+	
+	if(value == FRAME_ESCAPE)
+	{
+		PARSE_ESCAPE[port] = 1;
+		
+		return 0;
+	}
+	
+	if(PARSE_ESCAPE[port])
+	{
+		value ^= FRAME_XOR;
+		PARSE_ESCAPE[port] = 0;
+	}
+	
+	PARSE_CRC[port] = crc8(PARSE_CRC[port], value);
+	
+	// The header, then the parameters, followed by the CRC.
+	if(count < (FRAME_OVERHEAD + FRAME_MAX_PARAMS))
+	{
+		buffer[count] = value;
+	}
+	
+	if(count < 255)
+	{
+		PARSE_COUNT[port]++;
 	}
 	
 	return 0;
 }
+#endif
+
+// This function copies a complete transmission out of a port's parse buffer into the command
+// globals, along with as many parameters as it carried.
+void parseFinish(char port, char count)
+{
+	int i = 0;	// An iterator for looping.
+	
+	COMMAND_SOURCE = PARSE_BUFFER[port][0];
+	COMMAND_DESTINATION = PARSE_BUFFER[port][1];
+	COMMAND_TYPE = PARSE_BUFFER[port][2];
+	
+	for(i = 0; i < count; i++)
+	{
+		PARAM[i] = PARSE_BUFFER[port][PARSE_HEADER + i];
+	}
+}
+
+// This function starts every port's parser over, waiting for a start byte or a flag.
+void parseReset(void)
+{
+	int i = 0;	// An iterator for looping.
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		PARSE_STATE[i] = PARSE_IDLE;
+		PARSE_COUNT[i] = 0;
+	}
+}
+
+#if FEATURE_FRAMING
+// This function folds one byte into a CRC-8 using the polynomial x^8 + x^2 + x + 1.
+char crc8(char crc, char value)
+{
+	int i = 0;	// An iterator for looping.
+	
+	crc ^= value;
+	
+	for(i = 0; i < 8; i++)
+	{
+		if(crc & 0x80)
+		{
+			crc = (crc << 1) ^ CRC8_POLY;
+		}
+		else
+		{
+			crc <<= 1;
+		}
+	}
+	
+	return crc;
+}
+#endif
 
 // This function decodes the transmission and takes the correct action.
 void decodeTransmission(void)
 {
 	char* param;			// Stores the most recent parameter from the buffer.
-	char ID = 0;			// Stores the target module ID.
+	int ID = 0;				// Stores the target module ID.
+	char group = 0;			// Stores the target group number plus one, or 0 for a single ID.
 	char tempByte = 0;		// Temporary byte storage.
 	char angle[2];			// Store the two angle bytes for the servo.
 	char speed[2];			// Store the two speed bytes for the servo.
@@ -376,51 +1025,334 @@ void decodeTransmission(void)
 		{
 			// Reset the robot.
 			NUM_MODULES = 0;
+			DISCOVERY = DISCOVER_START;
+		}
+		else if((param[0] == 'a') || (param[0] == 'A'))
+		{
+			// Pick the addressing and find the robot again: A,S; starts IDs over at 1 on each
+			// port, so every port can have MAX_MODULES, and A,F; shares one ID space. With
+			// segmented addressing a module's ID is its port's segment times 256 plus the ID
+			// it answers to, so the modules on the first port keep their plain IDs.
+			if(param = COMP_SERIAL_szGetParam())
+			{
+				if((param[0] == 's') || (param[0] == 'S'))
+				{
+					ADDRESSING = ADDRESS_SEGMENTED;
+					NUM_MODULES = 0;
+					DISCOVERY = DISCOVER_START;
+				}
+				else if((param[0] == 'f') || (param[0] == 'F'))
+				{
+					ADDRESSING = ADDRESS_FLAT;
+					NUM_MODULES = 0;
+					DISCOVERY = DISCOVER_START;
+				}
+			}
+		}
+		else if((param[0] == 'q') || (param[0] == 'Q'))
+		{
+			// Report how discovery is going as Q,<step>,<port>,<modules>. The step is 0 once
+			// it is done, the port is the next one to be searched, and the modules found so far
+			// can already be used.
+			COMP_SERIAL_PutChar('Q');
+			COMP_SERIAL_PutChar(',');
+			COMP_SERIAL_PutChar('0' + DISCOVERY);
+			COMP_SERIAL_PutChar(',');
+			COMP_SERIAL_PutChar(PORT_1 + DISCOVER_PORT);
+			COMP_SERIAL_PutChar(',');
+			itoa(param,moduleCount(),10);
+			COMP_SERIAL_PutString(param);
+			COMP_SERIAL_PutChar('\n');
 		}
 		else if((param[0] == 'n') || (param[0] == 'N'))
 		{
-			itoa(param,NUM_MODULES,10);		// Convert the NUM_MODULES int to a char array.
+			itoa(param,moduleCount(),10);	// Convert the module count to a char array.
 			COMP_SERIAL_PutString(param);	// Send that array out to the PC.
 			COMP_SERIAL_PutChar('\n');		// End the transmission with the PC.
 		}
-		else if((param[0] == 'w') || (param[0] == 'W'))
+#if FEATURE_SNIFFER
+		else if((param[0] == 'm') || (param[0] == 'M'))
 		{
+			// Turn the bus sniffer on or off. Any captures still waiting are sent first.
+			if(param = COMP_SERIAL_szGetParam())
+			{
+				sniffFlush();
+				
+				SNIFF = atoi(param);
+				SNIFF_LOST = 0;
+			}
+		}
+#endif
+#if FEATURE_BRIDGE
+		else if((param[0] == 'b') || (param[0] == 'B'))
+		{
+			// Hand the servo bus over to the PC until it sends the escape sequence.
+			bridgeMode();
+		}
+#endif
+#if FEATURE_DUAL_WRITE
+		else if((param[0] == 'd') || (param[0] == 'D'))
+		{
+			// Move two servos at once: D,<id>,<angle>,<id>,<angle>;
 			if(param = COMP_SERIAL_szGetParam())
 			{
-				// Convert the ID parameter to a char byte.
 				ID = atoi(param);
 				
 				if(param = COMP_SERIAL_szGetParam())
 				{
-					if((param[0] == 'a') || (param[0] == 'A'))
+					// Get the first angle and convert it to bytes.
+					total = atoi(param);
+					angle[0] = total%256;
+					angle[1] = total/256;
+					
+					if(param = COMP_SERIAL_szGetParam())
 					{
+						runningTotal = atoi(param);
+						
 						if(param = COMP_SERIAL_szGetParam())
 						{
-							// Get the angle parameter and convert it to an integer.
+							// Get the second angle and send both.
 							total = atoi(param);
-							
-							// Convert the integer into bytes.
-							angle[0] = total%256;
-							angle[1] = total/256;
-							
-							// Send the servo the angle.
-							longServoInstruction(ID,5,WRITE_SERVO,30,angle[0],angle[1]);
+							dualServoWrite(ID,angle[0],angle[1],runningTotal,total%256,total/256,30);
 						}
 					}
-					else if((param[0] == 'p') || (param[0] == 'P'))
+				}
+			}
+		}
+#endif
+#if FEATURE_FRAMING
+		else if((param[0] == 'f') || (param[0] == 'F'))
+		{
+			// Turn CRC framing of module transmissions on or off. It is only used on the
+			// branches where every module supports it.
+			if(param = COMP_SERIAL_szGetParam())
+			{
+				FRAMING = atoi(param);
+				routeTo(0);
+			}
+		}
+#endif
+#if FEATURE_BULK
+		else if((param[0] == 'u') || (param[0] == 'U'))
+		{
+			// Bulk transfers: U,S,<id>; starts one (254 for every module), U,D,<hex>; adds data,
+			// and U,E; finishes it. Each is answered with U and a number. For S and E it is 1 on
+			// success and 0 on fail. For D it is the number of free chunks, or 0 if the data
+			// didn't fit and has to be sent again.
+			if(param = COMP_SERIAL_szGetParam())
+			{
+				tempByte = param[0];
+				total = 0;
+				
+				if((tempByte == 's') || (tempByte == 'S'))
+				{
+					if(param = COMP_SERIAL_szGetParam())
 					{
-						if(param = COMP_SERIAL_szGetParam())
-						{
-							// Send the servo the desired power value.
-							servoInstruction(ID,4,WRITE_SERVO,24,atoi(param));
-						}
+						total = bulkStart(atoi(param));
 					}
-					else if((param[0] == 's') || (param[0] == 'S'))
+				}
+				else if((tempByte == 'd') || (tempByte == 'D'))
+				{
+					// Data can only be added to a transfer that U,S opened.
+					if(BULK_ACTIVE && (param = COMP_SERIAL_szGetParam()))
 					{
-						if(param = COMP_SERIAL_szGetParam())
+						if(bulkAdd(param))
 						{
-							// Get the speed parameter and convert it to an integer.
-							total = atoi(param);
+							bulkRound();
+							
+							if(BULK_ACTIVE)
+							{
+								total = BULK_WINDOW - BULK_COUNT;
+							}
+						}
+					}
+				}
+				else if((tempByte == 'e') || (tempByte == 'E'))
+				{
+					total = bulkFinish();
+				}
+				
+				configToggle(PC_MODE);
+				
+				itoa(angle,total,10);
+				COMP_SERIAL_PutChar('U');
+				COMP_SERIAL_PutChar(',');
+				COMP_SERIAL_PutString(angle);
+				COMP_SERIAL_PutChar('\n');
+			}
+		}
+#endif
+#if FEATURE_TIME
+		else if((param[0] == 'c') || (param[0] == 'C'))
+		{
+			// Clock commands: C,S; resets every module's clock to the same tick, and C,A,<tick>;
+			// or C,A,<tick>,<id>; makes every module, or one module, hold its next command until
+			// its clock reaches the tick. Both are answered with C,1 on success or C,0 on fail.
+			if(param = COMP_SERIAL_szGetParam())
+			{
+				tempByte = param[0];
+				total = 0;
+				
+				if(((tempByte == 's') || (tempByte == 'S')) && NUM_MODULES)
+				{
+					total = timeSync();
+				}
+				else if((tempByte == 'a') || (tempByte == 'A'))
+				{
+					if(param = COMP_SERIAL_szGetParam())
+					{
+						runningTotal = atoi(param);
+						ID = BROADCAST;
+						
+						if(param = COMP_SERIAL_szGetParam())
+						{
+							ID = atoi(param);
+						}
+						
+						if((runningTotal >= 0) && (runningTotal <= TICK_MAX) && ((ID == BROADCAST) || portOf(ID)))
+						{
+							timeArm(ID,runningTotal);
+							total = 1;
+						}
+					}
+				}
+				
+				configToggle(PC_MODE);
+				
+				itoa(angle,total,10);
+				COMP_SERIAL_PutChar('C');
+				COMP_SERIAL_PutChar(',');
+				COMP_SERIAL_PutString(angle);
+				COMP_SERIAL_PutChar('\n');
+			}
+		}
+#endif
+		else if((param[0] == 'h') || (param[0] == 'H'))
+		{
+			// Check on the robot and send a '1' for each module in the table that answered and a '0'
+			// for each one that didn't, in the same order as T; lists them.
+			checkLive();
+			configToggle(PC_MODE);
+			
+			for(ID = nextModule(0); ID && tableEntry(ID); ID = nextModule(ID))
+			{
+				COMP_SERIAL_PutChar('0' + isLive(ID));
+			}
+			
+			COMP_SERIAL_PutChar('\n');
+		}
+#if FEATURE_TOPOLOGY_QUERY
+		else if((param[0] == 't') || (param[0] == 'T'))
+		{
+			// Send the whole module table.
+			sendTopology();
+		}
+#endif
+#if FEATURE_GROUPS
+		else if((param[0] == 'g') || (param[0] == 'G'))
+		{
+			// Set the members of a servo group: G,<group>,<id>,<id>,...;
+			if(param = COMP_SERIAL_szGetParam())
+			{
+				group = atoi(param);
+				
+				if(group < NUM_GROUPS)
+				{
+					// Start the group over.
+					for(total = 0; total < GROUP_BYTES; total++)
+					{
+						GROUP[group][total] = 0;
+					}
+					
+					// Add each ID listed. Only IDs up to TABLE_MODULES can be grouped, which with
+					// segmented addressing are the modules on the first port.
+					while(param = COMP_SERIAL_szGetParam())
+					{
+						ID = atoi(param);
+						
+						if((ID >= 1) && (ID <= TABLE_MODULES))
+						{
+							GROUP[group][(ID-1)/8] |= (1 << ((ID-1)%8));
+						}
+					}
+				}
+			}
+		}
+#endif
+		else if((param[0] == 'w') || (param[0] == 'W'))
+		{
+			if(param = COMP_SERIAL_szGetParam())
+			{
+#if FEATURE_GROUPS
+				// A leading G picks a group instead of a single ID, as in W,G1,A,512;
+				if((param[0] == 'g') || (param[0] == 'G'))
+				{
+					total = atoi(&param[1]);
+					
+					if((total >= 0) && (total < NUM_GROUPS))
+					{
+						group = total + 1;
+					}
+					else
+					{
+						// There is no such group, so mark it to have nothing sent.
+						group = NUM_GROUPS + 1;
+					}
+				}
+				
+#endif
+				// Convert the ID parameter to a char byte.
+				ID = atoi(param);
+				
+				if((group <= NUM_GROUPS) && (param = COMP_SERIAL_szGetParam()))
+				{
+					if((param[0] == 'a') || (param[0] == 'A'))
+					{
+						if(param = COMP_SERIAL_szGetParam())
+						{
+							// Get the angle parameter and convert it to an integer.
+							total = atoi(param);
+							
+							// Convert the integer into bytes.
+							angle[0] = total%256;
+							angle[1] = total/256;
+							
+							// Send the servo the angle.
+#if FEATURE_GROUPS
+							if(group)
+							{
+								groupWrite(group-1,30,2,angle[0],angle[1]);
+							}
+							else
+#endif
+							{
+								longServoInstruction(ID,5,WRITE_SERVO,30,angle[0],angle[1]);
+							}
+						}
+					}
+					else if((param[0] == 'p') || (param[0] == 'P'))
+					{
+						if(param = COMP_SERIAL_szGetParam())
+						{
+							// Send the servo the desired power value.
+#if FEATURE_GROUPS
+							if(group)
+							{
+								groupWrite(group-1,24,1,atoi(param),0);
+							}
+							else
+#endif
+							{
+								servoInstruction(ID,4,WRITE_SERVO,24,atoi(param));
+							}
+						}
+					}
+					else if((param[0] == 's') || (param[0] == 'S'))
+					{
+						if(param = COMP_SERIAL_szGetParam())
+						{
+							// Get the speed parameter and convert it to an integer.
+							total = atoi(param);
 							
 							// If no total, do nothing because 0 is no speed control (undesired).
 							if(total)
@@ -430,7 +1362,16 @@ void decodeTransmission(void)
 								speed[1] = total/256;
 								
 								// Write the speed value to the servo.
-								longServoInstruction(ID,5,WRITE_SERVO,32,speed[0],speed[1]);
+#if FEATURE_GROUPS
+								if(group)
+								{
+									groupWrite(group-1,32,2,speed[0],speed[1]);
+								}
+								else
+#endif
+								{
+									longServoInstruction(ID,5,WRITE_SERVO,32,speed[0],speed[1]);
+								}
 							}
 						}
 					}
@@ -455,16 +1396,19 @@ void decodeTransmission(void)
 						// Send a request to the servo for its angle.
 						servoInstruction(ID,4,READ_SERVO,36,2);
 						
-						// Switch to read the response.
+						// Switch to read the response. Servo replies aren't module transmissions,
+						// so let every byte through.
 						configToggle(RX_MODE);
+						setRxWindow(ID);
+						filterPorts(0);
 							
 						// Loop until we read a response or time out.
-						while(TIMEOUT < RX_TIMEOUT_DURATION)
+						while(TIMEOUT < RX_WINDOW)
 						{
 							// If the response is from the right ID...
-							if(iReadChar() == ID)
+							if(iReadChar() == wireID(ID))
 							{
-								while(TIMEOUT < RX_TIMEOUT_DURATION)
+								while(TIMEOUT < RX_WINDOW)
 								{
 									// The length of the response remainder should be 4.
 									if(iReadChar() == 4)
@@ -476,6 +1420,8 @@ void decodeTransmission(void)
 											angle[0] = readChar();
 											angle[1] = readChar();
 											
+											measureRTT(ID);
+											
 											// Switch to PC mode to forward the response.
 											configToggle(PC_MODE);
 											
@@ -490,12 +1436,12 @@ void decodeTransmission(void)
 											COMP_SERIAL_PutChar('\n');
 
 											// Force a timeout to exit all loops.
-											TIMEOUT = RX_TIMEOUT_DURATION;
+											TIMEOUT = RX_WINDOW;
 										}
 										else
 										{
 											// Force a timeout to exit all loops.
-											TIMEOUT = RX_TIMEOUT_DURATION;
+											TIMEOUT = RX_WINDOW;
 										}
 									}
 								}
@@ -507,17 +1453,20 @@ void decodeTransmission(void)
 						// Send a request to the servo for its power status.
 						servoInstruction(ID,4,READ_SERVO,24,1);
 						
-						// Switch to read the response.
+						// Switch to read the response. Servo replies aren't module transmissions,
+						// so let every byte through.
 						configToggle(RX_MODE);
+						setRxWindow(ID);
+						filterPorts(0);
 						
 						// Loop until we read a response or time out.
-						while(TIMEOUT < RX_TIMEOUT_DURATION)
+						while(TIMEOUT < RX_WINDOW)
 						{
-							if(iReadChar() == ID)
+							if(iReadChar() == wireID(ID))
 							{
-								runningTotal = ID;
+								runningTotal = wireID(ID);
 								// Loop until we read a response or time out.
-								while(TIMEOUT < RX_TIMEOUT_DURATION)
+								while(TIMEOUT < RX_WINDOW)
 								{
 									// Check the length of the packet.
 									if(iReadChar() == 3)
@@ -526,11 +1475,13 @@ void decodeTransmission(void)
 										runningTotal += 3;
 										
 										// Loop until we read a response or time out.
-										while(TIMEOUT < RX_TIMEOUT_DURATION)
+										while(TIMEOUT < RX_WINDOW)
 										{
 											// Check for the checksum or 1.
 											if(tempByte = iReadChar())
 											{
+												measureRTT(ID);
+												
 												// Switch to PC mode to forward the result.
 												configToggle(PC_MODE);
 												
@@ -547,7 +1498,7 @@ void decodeTransmission(void)
 													COMP_SERIAL_PutChar('\n');
 												}
 		
-												TIMEOUT = RX_TIMEOUT_DURATION;
+												TIMEOUT = RX_WINDOW;
 											}
 										}
 									}
@@ -564,6 +1515,12 @@ void decodeTransmission(void)
 							COMP_SERIAL_PutChar(TYPE);
 							COMP_SERIAL_PutChar('\n');
 						}
+						else if(portOf(ID) && (total = tableEntry(ID)) && MODULE_TYPE[total-1])
+						{
+							// Answer from the table that discovery filled in.
+							COMP_SERIAL_PutChar(MODULE_TYPE[total-1]);
+							COMP_SERIAL_PutChar('\n');
+						}
 						else if(pingModule(ID))
 						{
 							configToggle(PC_MODE);
@@ -581,6 +1538,20 @@ void decodeTransmission(void)
 							COMP_SERIAL_PutChar(CHILD);
 							COMP_SERIAL_PutChar('\n');
 						}
+						else if(portOf(ID) && (total = tableEntry(ID)) && MODULE_TYPE[total-1])
+						{
+							// Answer from the table that discovery filled in.
+							if(MODULE_CHILD[total-1])
+							{
+								COMP_SERIAL_PutChar(MODULE_CHILD[total-1]);
+							}
+							else
+							{
+								COMP_SERIAL_PutChar('0');
+							}
+							
+							COMP_SERIAL_PutChar('\n');
+						}
 						else if(pingModule(ID))
 						{	
 							configToggle(PC_MODE);
@@ -608,78 +1579,93 @@ void decodeTransmission(void)
 
 // This function receives a destination, command length, instruction type, address, and value.
 // With these parameters, the function sends a packet to the communication bus.
-void servoInstruction(char id, char length, char instruction, char address, char value)
+void servoInstruction(int id, char length, char instruction, char address, char value)
 {
 	char checksum;	// The checksum byte value.
 	int total;		// The total for use in calculating the checksum.
 	
+	// Drop the instruction if an emergency stop came in since this command started.
+	if(ESTOP)
+	{
+		return;
+	}
+	
+	// Only talk through the port that leads to the servo. If we don't know where it is, talk
+	// through all of them.
+	if(portOf(id))
+	{
+		selectModule(id);
+	}
+	else
+	{
+		routeTo(0);
+	}
+	
 	// Get the total of all bytes.
-	total = id + length + instruction + address + value;
+	total = wireID(id) + length + instruction + address + value;
 	
 	// Calculate the checksum value for our servo communication.
 	checksum = 255-(total%256);
 	
 	// Talk to the servo.
-	TX_REPEATER_14_PutChar(SERVO_START);	// Start byte one
-	TX_REPEATER_23_PutChar(SERVO_START);	// Start byte one
-	TX_REPEATER_14_PutChar(SERVO_START);	// Start byte two
-	TX_REPEATER_23_PutChar(SERVO_START);	// Start byte two
-	TX_REPEATER_14_PutChar(id);			// The servo ID
-	TX_REPEATER_23_PutChar(id);				// The servo ID
-	TX_REPEATER_14_PutChar(length);		// Remaining packet length
-	TX_REPEATER_23_PutChar(length);			// Remaining packet length
-	TX_REPEATER_14_PutChar(instruction);	// Servo instruction
-	TX_REPEATER_23_PutChar(instruction);	// Servo instruction
-	TX_REPEATER_14_PutChar(address);		// Target memory address on the servo EEPROM
-	TX_REPEATER_23_PutChar(address);		// Target memory address on the servo EEPROM
-	TX_REPEATER_14_PutChar(value);			// The write value or number of bytes to read
-	TX_REPEATER_23_PutChar(value);			// The write value or number of bytes to read
-	TX_REPEATER_14_PutChar(checksum);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(checksum);		// This is the end of this transmission
+	busPutChar(SERVO_START);	// Start byte one
+	busPutChar(SERVO_START);	// Start byte two
+	busPutChar(wireID(id));		// The servo ID
+	busPutChar(length);			// Remaining packet length
+	busPutChar(instruction);	// Servo instruction
+	busPutChar(address);		// Target memory address on the servo EEPROM
+	busPutChar(value);			// The write value or number of bytes to read
+	busPutChar(checksum);		// This is the end of this transmission
 	
 	// Wait for the transmission to finish.
-	while(!(TX_REPEATER_14_bReadTxStatus() & TX_REPEATER_14_TX_COMPLETE));
-	while(!(TX_REPEATER_23_bReadTxStatus() & TX_REPEATER_23_TX_COMPLETE));
+	busWait();
 	
 	// Make completely sure we're done.
 	xmitWait();
 }
 
 // This function receives a destination, command length, instruction type, address, and two values.
-void longServoInstruction(char id, char length, char instruction, char address, char value1, char value2)
+void longServoInstruction(int id, char length, char instruction, char address, char value1, char value2)
 {
 	char checksum;	// The checksum byte value.
 	int total;		// The total for use in calculating the checksum.
 	
+	// Drop the instruction if an emergency stop came in since this command started.
+	if(ESTOP)
+	{
+		return;
+	}
+	
+	// Only talk through the port that leads to the servo. If we don't know where it is, talk
+	// through all of them.
+	if(portOf(id))
+	{
+		selectModule(id);
+	}
+	else
+	{
+		routeTo(0);
+	}
+	
 	// Get the total of all bytes.
-	total = id + length + instruction + address + value1 + value2;
+	total = wireID(id) + length + instruction + address + value1 + value2;
 	
 	// Calculate the checksum value for our servo communication.
 	checksum = 255-(total%256);
 	
 	// Talk to the servo.
-	TX_REPEATER_14_PutChar(SERVO_START);	// Start byte one
-	TX_REPEATER_23_PutChar(SERVO_START);	// Start byte one
-	TX_REPEATER_14_PutChar(SERVO_START);	// Start byte two
-	TX_REPEATER_23_PutChar(SERVO_START);	// Start byte two
-	TX_REPEATER_14_PutChar(id);			// The servo ID
-	TX_REPEATER_23_PutChar(id);				// The servo ID
-	TX_REPEATER_14_PutChar(length);		// Remaining packet length
-	TX_REPEATER_23_PutChar(length);			// Remaining packet length
-	TX_REPEATER_14_PutChar(instruction);	// Servo instruction
-	TX_REPEATER_23_PutChar(instruction);	// Servo instruction
-	TX_REPEATER_14_PutChar(address);		// Target memory address on the servo EEPROM
-	TX_REPEATER_23_PutChar(address);		// Target memory address on the servo EEPROM
-	TX_REPEATER_14_PutChar(value1);		// The first write value
-	TX_REPEATER_23_PutChar(value1);			// The first write value
-	TX_REPEATER_14_PutChar(value2);		// The second write value
-	TX_REPEATER_23_PutChar(value2);			// The second write value
-	TX_REPEATER_14_PutChar(checksum);		// This is the end of this transmission
-	TX_REPEATER_23_PutChar(checksum);		// This is the end of this transmission
+	busPutChar(SERVO_START);	// Start byte one
+	busPutChar(SERVO_START);	// Start byte two
+	busPutChar(wireID(id));		// The servo ID
+	busPutChar(length);			// Remaining packet length
+	busPutChar(instruction);	// Servo instruction
+	busPutChar(address);		// Target memory address on the servo EEPROM
+	busPutChar(value1);			// The first write value
+	busPutChar(value2);			// The second write value
+	busPutChar(checksum);		// This is the end of this transmission
 	
 	// Wait for the transmission to finish.
-	while(!(TX_REPEATER_14_bReadTxStatus() & TX_REPEATER_14_TX_COMPLETE));
-	while(!(TX_REPEATER_23_bReadTxStatus() & TX_REPEATER_23_TX_COMPLETE));
+	busWait();
 	
 	// Make completely sure we're done.
 	xmitWait();
@@ -689,6 +1675,13 @@ void longServoInstruction(char id, char length, char instruction, char address,
 // half duplex UART serial communication line.
 void configToggle(int mode)
 {
+	// If we are leaving PC mode without having sent anything, drop the pending settle wait.
+	if(SETTLING)
+	{
+		TX_TIMEOUT_Stop();
+		SETTLING = 0;
+	}
+	
 	// Disconnect from the global bus and leave the pin high.
 	PRT0DR |= 0b11111111;
 	PRT0GS &= 0b00000000;
@@ -708,55 +1701,97 @@ void configToggle(int mode)
 	{
 		LoadConfig_pc_listener();
 
-		COMP_SERIAL_CmdReset();								// Initialize the buffer.
-		COMP_SERIAL_IntCntl(COMP_SERIAL_ENABLE_RX_INT); 	// Enable RX interrupts  
-		COMP_SERIAL_Start(UART_PARITY_NONE);				// Starts the UART.
+		// Initialize the buffer, unless the PC is partway through sending a command.
+		if(!COMP_SERIAL_bRxCnt || (COMP_SERIAL_fStatus & COMP_SERIAL_RX_BUF_CMDTERM))
+		{
+			COMP_SERIAL_CmdReset();
+		}
 		
+		// The repeaters have to be running before the PC can interrupt us, since an emergency
+		// stop sends its torque off through them as soon as it arrives.
 		TX_REPEATER_14_Start(TX_REPEATER_14_PARITY_NONE);	// Start the 014 TX repeater.
 		TX_REPEATER_23_Start(TX_REPEATER_23_PARITY_NONE);	// Start the 23 TX repeater.
 		
+		COMP_SERIAL_IntCntl(COMP_SERIAL_ENABLE_RX_INT); 	// Enable RX interrupts  
+		COMP_SERIAL_Start(UART_PARITY_NONE);				// Starts the UART.
+		
 		TIMEOUT = 0;			// Clear the timeout flag.
 		TX_TIMEOUT_EnableInt();	// Make sure interrupts are enabled.
 		TX_TIMEOUT_Start();		// Start the timer.
 		
-		// Do nothing while we allow everyone to load the right configuration.
-		while(!TIMEOUT){ }
-		
-		// Stop the timer and reset the timeout flag.
-		TX_TIMEOUT_Stop();
-		TIMEOUT = 0;
+		// Everyone needs time to load the right configuration before we talk on the bus, but the
+		// PC can be talked to right away. The rest of the wait is done by busSettle before the
+		// next bus transmission, so replies are passed along to the PC as soon as we get here.
+		SETTLING = 1;
 		
 		// Store the state.
 		STATE = PC_MODE;
+		
+#if FEATURE_SNIFFER
+		// This is the first chance to pass along what the sniffer heard, including the bytes
+		// from the last window that nobody read.
+		if(SNIFF)
+		{
+			sniffRing();
+		}
+		
+		if(SNIFF_COUNT || (SNIFF && RING_LOST))
+		{
+			sniffFlush();
+		}
+#endif
 	}
 	else if(mode == RX_MODE)
 	{
 		LoadConfig_receiver_config();
 		
+		// Anything left in the ring is from the last window, so throw it out.
+		RING_HEAD = 0;
+		RING_TAIL = 0;
+#if FEATURE_SNIFFER
+		RING_SNIFF = 0;
+#endif
+		
+		// Same goes for anything the parsers were in the middle of.
+		parseReset();
+		
+		// Replies come back in the format the request went out in. A window that asked more than
+		// one port can change this afterward.
+		RX_FRAMED = FRAMED ? 0xFF : 0;
+		
+		// Drop transmissions for other modules unless we are told otherwise. This also starts
+		// each port's filter over.
+		filterPorts(1);
+		
 		// Start the receivers.
 		// The seemingly unnecessary brackets around each line are unfortunately needed.
 		{
 		// Start listening for a response through child port 1.
 		RECEIVE_1_Start(RECEIVE_1_PARITY_NONE);
+		RECEIVE_1_EnableInt();
 		}
 		
 		{
 		// Start listening for a response through child port 2.
 		RECEIVE_2_Start(RECEIVE_2_PARITY_NONE);
+		RECEIVE_2_EnableInt();
 		}
 		
 		{
 		// Start listening for a response through child port 3.
 		RECEIVE_3_Start(RECEIVE_3_PARITY_NONE);
+		RECEIVE_3_EnableInt();
 		}
 		
 		{
 		// Start listening for a response through child port 4.
 		RECEIVE_4_Start(RECEIVE_4_PARITY_NONE);
+		RECEIVE_4_EnableInt();
 		}
 		
 		// Start response timeout timer and enable its interrupt routine.
 		TIMEOUT = 0;
+		RX_WINDOW = RX_TIMEOUT_DURATION;
 		RX_TIMEOUT_EnableInt();
 		RX_TIMEOUT_Start();
 		
@@ -764,8 +1799,16 @@ void configToggle(int mode)
 		STATE = RX_MODE;
 	}
 	
-	// Reconnect to the global bus.
-	PRT0GS |= 0b11111111;
+	// Reconnect to the global bus. While transmitting, ports that aren't routed are left
+	// disconnected and idling high, so only the modules we are talking to hear us.
+	if(mode == PC_MODE)
+	{
+		PRT0GS |= (~PORT_PINS | ROUTE);
+	}
+	else
+	{
+		PRT0GS |= 0b11111111;
+	}
 }
 
 // This function blindly unloads all user configurations. This will be called once,
@@ -792,204 +1835,2709 @@ void unloadConfig(int config_num)
 
 void initializeChildren(void)
 {
-	int num_timeouts = 0;	// The number of consecutive timeouts.
-	int ping_tries = 5;		// The number of times to try a ping on an unregistered module.
 	int i = 0;				// An iterator for looping.
 	
 	// Set num modules to zero.
 	NUM_MODULES = 0;
 	
-	// Set the child value to zero.
-	CHILD = 0;	
-	
-	while(CHILD == 0)
+	// Take on the addressing the PC asked for, if it asked.
+	if(ADDRESSING)
 	{
-		// Send out a probing message.
-		sayHello();
-		
-		// Listen for a response.
-		childListen();
+		SEGMENTED = (ADDRESSING == ADDRESS_SEGMENTED);
 	}
 	
-	// Send out a probing message.
-	sayHello();
-	
-	// This loop continuously probes and listens at intervals
-	// set by the RX_TIMEOUT_DURATION variable.
-	while(num_timeouts < MAX_TIMEOUTS)
-	{	
-		if(validTransmission())
-		{
-			if(COMMAND_TYPE == HELLO_BYTE)	// Someone else is out there!
-			{
-				// If this is for me, assign them an ID.
-				if(COMMAND_DESTINATION == PARENT_ID)
-				{
-					NUM_MODULES++;			// Increment the number of modules connected.
-					num_timeouts = 0;		// Reset number of timeouts since we found someone.
-		
-					if(!assignID(NUM_MODULES))
-					{
-						// If the module did not respond that the ID was assigned,
-						// make an effort to ping it in case that transmission was lost
-						// before ultimately deciding that the module didn't configure.
-						for(i = 0; i < ping_tries; i++)
-						{	
-							if(pingModule(NUM_MODULES))
-							{
-								i = ping_tries+1;
-							}
-						}
-						
-						// If we landed right at ping_tries, we failed.
-						if(i == ping_tries)
-						{
-							NUM_MODULES--;
-						}
-					}
-				}
-			}
-		}
-		else if(TIMEOUT >= RX_TIMEOUT_DURATION)
-		{	
-			// Only increment the number of timeouts if we have found a module.
-			if(NUM_MODULES)
-			{
-				num_timeouts++;
-			}
-			else
-			{
-				// Wait additional time between transmissions if no modules have been found.
-				// This is done to give the first child a chance to configure if it hasn't.
-				while(TIMEOUT < INIT_WAIT_TIME) { }
-			}
-			
-			// If we are not maxed out on modules, look for more.
-			if(NUM_MODULES < MAX_MODULES)
-			{
-				sayHello();
-			}
-		}
+	// Forget what we learned about the old modules.
+	for(i = 0; i < TABLE_MODULES; i++)
+	{
+		RTT_AVERAGE[i] = 0;
+		RTT_DEVIATION[i] = 0;
 	}
 	
-	// If we didn't find any new modules, check to see if some already exist.
-	if(!NUM_MODULES)
+	// Nothing is known about the ports until they are searched, so don't frame anything yet.
+	for(i = 0; i < NUM_PORTS; i++)
 	{
-		// Try to ping the next module up from our current number ping_tries times.
-		for(i = 0; i < ping_tries; i++)
-		{	
-			if(pingModule(NUM_MODULES+1))
-			{
-				NUM_MODULES++;
-				i = 0;
-			}
-		}
+		PORT_FIRST[i] = 0;
+		PORT_COUNT[i] = 0;
+		PORT_CAPS[i] = 0;
 	}
 	
-	// Switch back to PC mode.
-	configToggle(PC_MODE);
+	// Set the child value to zero.
+	CHILD = 0;
+	
+	// The ports are searched one at a time by discoverStep, starting with the first.
+	DISCOVER_PORT = 0;
+	DISCOVERY = DISCOVER_PORTS;
 }
 
-// This function listens for children and registers the port that they talk to.
-void childListen(void)
-{	
-	// Wait to either hear a child or time out.
-	while(TIMEOUT < RX_TIMEOUT_DURATION)
-	{		
-		// Check all of the ports for a start byte. Only one port will produce one.
-		// Only non-blocking commands are used to avoid getting stuck listening downstream.
-		if(RECEIVE_1_cReadChar() == START_TRANSMIT)
-		{
-			while(TIMEOUT < RX_TIMEOUT_DURATION)
-			{
-				if(RECEIVE_1_cReadChar() == END_TRANSMIT)
-				{
-					CHILD = PORT_1;
-				}
-			}
-		}
-		else if(RECEIVE_2_cReadChar() == START_TRANSMIT)
+// This function takes one step of discovery and goes back to PC mode, so that the PC is answered
+// between steps instead of waiting for the whole robot to be found. The first step loads the saved
+// table, or starts a search if it doesn't match the robot. Each search step numbers the modules on
+// one port, and they can be used as soon as it is done. The ports are searched over and over until
+// at least one of them has modules on it, since each port gets its own range of IDs, handed out in
+// port order. Then the types and features of everything are read and the table is saved.
+void discoverStep(void)
+{
+	if(DISCOVERY == DISCOVER_START)
+	{
+#if FEATURE_TOPOLOGY_CACHE
+		// Only search the bus if the table saved in flash no longer matches the robot.
+		if(loadTopology())
 		{
-			while(TIMEOUT < RX_TIMEOUT_DURATION)
-			{
-				if(RECEIVE_2_cReadChar() == END_TRANSMIT)
-				{
-					CHILD = PORT_2;
-				}
-			}
+			DISCOVERY = DISCOVER_IDLE;
 		}
-		else if(RECEIVE_3_cReadChar() == START_TRANSMIT)
+		else
 		{
-			while(TIMEOUT < RX_TIMEOUT_DURATION)
-			{
-				if(RECEIVE_3_cReadChar() == END_TRANSMIT)
-				{
-					CHILD = PORT_3;
-				}
-			}
+			initializeChildren();
 		}
-		else if(RECEIVE_4_cReadChar() == START_TRANSMIT)
+#else
+		initializeChildren();
+#endif
+	}
+	else if(DISCOVERY == DISCOVER_PORTS)
+	{
+		initializePort(PORT_1 + DISCOVER_PORT);
+		DISCOVER_PORT++;
+		
+		// Start the next pass over the ports, unless this one found something.
+		if(DISCOVER_PORT >= NUM_PORTS)
 		{
-			while(TIMEOUT < RX_TIMEOUT_DURATION)
+			DISCOVER_PORT = 0;
+			
+			if(NUM_MODULES)
 			{
-				if(RECEIVE_4_cReadChar() == END_TRANSMIT)
-				{
-					CHILD = PORT_4;
-				}
+				DISCOVERY = DISCOVER_TYPES;
 			}
 		}
 	}
+	else if(DISCOVERY == DISCOVER_TYPES)
+	{
+		readTypes();
+		
+		// Find out what each branch can do, so that the next start up doesn't have to ask.
+		readCapabilities();
+#if FEATURE_TOPOLOGY_CACHE
+		saveTopology();
+#endif
+		
+		DISCOVERY = DISCOVER_IDLE;
+	}
+	
+	// Listen to the first module's port and transmit on every port until told otherwise.
+	selectModule(1);
+	routeTo(0);
+	
+	// Switch back to PC mode.
+	configToggle(PC_MODE);
 }
 
-// This function converts the PSoC cReadChar calls of all ports into a single return.
-char iReadChar(void)
+// This function finds the chain of modules on one port. Transmissions only go out of that port
+// while we do this, so blank modules on the other ports don't answer and take the same IDs. With
+// segmented addressing the port's IDs start over at 1, in its own segment.
+void initializePort(char port)
 {
-	if(CHILD == PORT_1)
+	int highest = NUM_MODULES;		// The highest ID handed out before this port.
+	int first = NUM_MODULES + 1;	// The first ID handed out on this port.
+#if FEATURE_ENUMERATE
+	int count = 0;					// The module count reported by a numbering pass.
+#endif
+	int num_timeouts = 0;			// The number of consecutive timeouts.
+	int init_waits = 0;				// The number of waits for the first module on this port.
+	int ping_tries = 5;				// The number of times to try a ping on an unregistered module.
+	int i = 0;						// An iterator for looping.
+	
+	// Only talk and listen through this port.
+	CHILD = port;
+	routeTo(port);
+	
+	// Send out a probing message, and move on if no one answers.
+	sayHello();
+	
+	if(!childListen())
+	{
+		return;
+	}
+	
+	// Start numbering at the beginning of this port's segment.
+	if(SEGMENTED)
+	{
+		first = ((port - PORT_1) << SEGMENT_SHIFT) + 1;
+		NUM_MODULES = first - 1;
+	}
+	
+#if FEATURE_ENUMERATE
+	// Try to number the whole chain in one pass. If the modules don't answer, they are
+	// numbered one at a time below.
+	if(count = enumerateChain())
+	{
+		NUM_MODULES = count;
+	}
+	else
+#endif
+	{
+		// Send out a probing message.
+		sayHello();
+		
+		// This loop continuously probes and listens at intervals
+		// set by the RX_WINDOW variable.
+		while((num_timeouts < MAX_TIMEOUTS) && (init_waits < MAX_INIT_WAITS))
+		{	
+			if(validTransmission())
+			{
+				if(COMMAND_TYPE == HELLO_BYTE)	// Someone else is out there!
+				{
+					// If this is for me, assign them an ID.
+					if(COMMAND_DESTINATION == PARENT_ID)
+					{
+						NUM_MODULES++;			// Increment the number of modules connected.
+						num_timeouts = 0;		// Reset number of timeouts since we found someone.
+			
+						if(!assignID(NUM_MODULES))
+						{
+							// If the module did not respond that the ID was assigned,
+							// make an effort to ping it in case that transmission was lost
+							// before ultimately deciding that the module didn't configure.
+							for(i = 0; i < ping_tries; i++)
+							{	
+								if(pingModule(NUM_MODULES))
+								{
+									i = ping_tries+1;
+								}
+							}
+							
+							// If we landed right at ping_tries, we failed.
+							if(i == ping_tries)
+							{
+								NUM_MODULES--;
+							}
+						}
+					}
+				}
+			}
+			else if(TIMEOUT >= RX_WINDOW)
+			{	
+				// Only increment the number of timeouts if we have found a module on this port.
+				if(NUM_MODULES >= first)
+				{
+					num_timeouts++;
+				}
+				else
+				{
+					// Wait additional time between transmissions if no modules have been found.
+					// This is done to give the first child a chance to configure if it hasn't.
+					// Something answered the first hello, but if no blank module ever does, give
+					// up after a few waits so that the step ends. The next pass tries again.
+					while(TIMEOUT < INIT_WAIT_TIME) { }
+					init_waits++;
+				}
+				
+				// If we are not maxed out on modules, look for more.
+				if((NUM_MODULES - (SEGMENTED ? (first - 1) : 0)) < MAX_MODULES)
+				{
+					sayHello();
+				}
+			}
+		}
+		
+		// If we didn't find any new modules, check to see if some already exist.
+		if(NUM_MODULES < first)
+		{
+			// Try to ping the next module up from our current number ping_tries times.
+			for(i = 0; i < ping_tries; i++)
+			{	
+				if(pingModule(NUM_MODULES+1))
+				{
+					NUM_MODULES++;
+					i = 0;
+				}
+			}
+		}
+	}
+	
+	// Record the range of IDs that live on this port.
+	if(NUM_MODULES >= first)
+	{
+		PORT_FIRST[port - PORT_1] = first;
+		PORT_COUNT[port - PORT_1] = NUM_MODULES - first + 1;
+	}
+	else
+	{
+		NUM_MODULES = highest;
+	}
+}
+
+#if FEATURE_ENUMERATE
+// This function sends a single numbering packet down the chain. Each blank module takes the ID in
+// the packet, adds one to it, and passes it on. The last module answers with the ID it took, which
+// is the number of modules in the chain. That count is confirmed with a ping of the last module.
+int enumerateChain(void)
+{
+	int count = 0;	// The number of modules reported by the end of the chain.
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	// Blank modules only understand the original format.
+	FRAMED = 0;
+	
+	// Transmit the numbering packet, with the first ID to hand out.
+	sendCommand(BLANK_MODULE_ID,ENUMERATE,1,wireID(NUM_MODULES+1));
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	// Switch to listening mode, and give the packet time to travel the chain and back.
+	configToggle(RX_MODE);
+	RX_WINDOW = ENUM_TIMEOUT_DURATION;
+	
+	// Listen for the end of the chain to answer.
+	while(TIMEOUT < RX_WINDOW)
+	{
+		if(validTransmission())
+		{
+			// If this is the count we are looking for, make sure it is from the last module.
+			if((COMMAND_TYPE == ENUMERATE) && (COMMAND_DESTINATION == PARENT_ID))
+			{
+				if(PARAM[0] == wireID(COMMAND_SOURCE))
+				{
+					count = COMMAND_SOURCE;
+					
+					// Force a timeout to exit the loop.
+					TIMEOUT = RX_WINDOW;
+				}
+			}
+		}
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	// Make sure the last module really is out there before trusting the count.
+	if(count && pingModule(count))
+	{
+		return count;
+	}
+	
+	return 0;
+}
+#endif
+
+// This function sizes the receive window for a module the way TCP sizes its retransmit timer,
+// as the smoothed round trip time plus four times its deviation. Near modules get a short window
+// so that failures resolve quickly, and far modules get a long one so they stop timing out.
+// Modules that have not been measured yet get the default window.
+void setRxWindow(int module_id)
+{
+	int window = RX_TIMEOUT_DURATION*RTT_SCALE;	// The window in 1/RTT_SCALE ms units.
+	int entry = tableEntry(module_id);			// The module's table entry.
+	
+	if(entry)
+	{
+		if(RTT_AVERAGE[entry-1])
+		{
+			window = RTT_AVERAGE[entry-1] + 4*RTT_DEVIATION[entry-1];
+		}
+	}
+	
+	// Round up to whole timer ticks and keep the window within sane bounds.
+	window = (window + RTT_SCALE - 1)/RTT_SCALE;
+	
+	if(window < RX_WINDOW_MIN)
+	{
+		window = RX_WINDOW_MIN;
+	}
+	else if(window > RX_WINDOW_MAX)
+	{
+		window = RX_WINDOW_MAX;
+	}
+	
+	RX_WINDOW = window;
+}
+
+// This function measures the time since the receive window opened, which is the time since our
+// last byte went out, and folds it into the module's smoothed round trip time and deviation.
+// It must be called as soon as the reply is read, while the receive timer is still loaded.
+void measureRTT(int module_id)
+{
+	int sample = 0;		// The round trip time just measured.
+	int error = 0;		// The difference between the sample and the average.
+	int entry = tableEntry(module_id);	// The module's table entry.
+	
+	if(!entry)
+	{
+		return;
+	}
+	
+	// Add the part of a tick that has passed to the whole ticks counted by the interrupt.
+	sample = TIMEOUT*RTT_SCALE + ((RX_TIMEOUT_PERIOD - RX_TIMEOUT_wReadTimer())*RTT_SCALE)/RX_TIMEOUT_PERIOD;
+	
+	if(sample < 1)
+	{
+		sample = 1;
+	}
+	else if(sample > 255)
+	{
+		sample = 255;
+	}
+	
+	if(!RTT_AVERAGE[entry-1])
+	{
+		// The first sample sets the average, with plenty of room for error.
+		RTT_AVERAGE[entry-1] = sample;
+		RTT_DEVIATION[entry-1] = sample/2;
+	}
+	else
+	{
+		// Move the average an eighth and the deviation a quarter of the way toward the sample.
+		error = sample - RTT_AVERAGE[entry-1];
+		RTT_AVERAGE[entry-1] += error/8;
+		
+		if(error < 0)
+		{
+			error = -error;
+		}
+		
+		RTT_DEVIATION[entry-1] += (error - RTT_DEVIATION[entry-1])/4;
+	}
+}
+
+// This function pings every module in the table to record its type and child port. The modules
+// are asked PIPE_WINDOW at a time, and any that don't answer are asked again one at a time.
+void readTypes(void)
+{
+	int i = 0;		// The module being asked.
+#if FEATURE_PIPELINE
+	int j = 0;		// An iterator for looping.
+#endif
+	int entry = 0;	// The module's table entry.
+	
+	for(i = 0; i < TABLE_MODULES; i++)
+	{
+		MODULE_TYPE[i] = 0;
+		MODULE_CHILD[i] = 0;
+	}
+	
+#if FEATURE_PIPELINE
+	// Ask the modules what they are a window at a time.
+	for(i = nextModule(0); i && tableEntry(i); )
+	{
+		pipelinePing(i, PIPE_WINDOW);
+		
+		for(j = 0; (j < PIPE_WINDOW) && i; j++)
+		{
+			i = nextModule(i);
+		}
+	}
+	
+#endif
+	// Ask anyone who didn't answer on their own.
+	for(i = nextModule(0); i && (entry = tableEntry(i)); i = nextModule(i))
+	{
+		if(!MODULE_TYPE[entry-1] && pingModule(i))
+		{
+			MODULE_TYPE[entry-1] = PARAM[0];
+			MODULE_CHILD[entry-1] = PARAM[1];
+		}
+	}
+	
+	// Switch back to PC mode.
+	configToggle(PC_MODE);
+}
+
+#if FEATURE_PIPELINE
+// This function pings a run of modules without waiting for each reply. Every ping carries its own
+// sequence number, and the pings all go out back to back, each through the port that leads to its
+// module. Then every port is listened to for one window that is as long as the longest one the
+// modules need. Replies can come back in any order, and each is matched to its request by the
+// sequence number the module echoes after its type and child port. Modules that don't echo it are
+// matched by who the reply is from. The type and child port of each module that answers go in the
+// table. The run is the first module and the ones after it in
+// the port table, and it stops early at the end of the table. Returns the number of modules that
+// answered.
+int pipelinePing(int first, int count)
+{
+	char base = 0;			// The sequence number of the first request.
+	char slot = 0;			// The request a reply belongs to.
+	int window = 0;			// The longest receive window any of the modules needs.
+	int answered = 0;		// The number of modules that answered.
+	int id = first;			// The module the next request goes to.
+	int entry = 0;			// The table entry of a module that answered.
+	char framed = 0;		// The ports whose requests went out framed.
+	int i = 0;				// An iterator for looping.
+	
+	// Keep the run inside the window.
+	if(count > PIPE_WINDOW)
+	{
+		count = PIPE_WINDOW;
+	}
+	
+	// In the original format a parameter has to stay between 1 and 199, clear of the start and end
+	// bytes, so the numbers start over before a run would go past that. The framing can change from
+	// one module in the run to the next, so this is done even if the last route was framed.
+	if((PIPE_SEQ < PIPE_SEQ_FIRST) || ((PIPE_SEQ + count - 1) > PIPE_SEQ_LAST))
+	{
+		PIPE_SEQ = PIPE_SEQ_FIRST;
+	}
+	
+	base = PIPE_SEQ;
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	// Send out all of the requests.
+	for(i = 0; (i < count) && id && tableEntry(id); i++)
+	{
+		PIPE_ID[i] = id;
+		
+		selectModule(id);
+		sendCommand(id,PING,1,PIPE_SEQ);
+		PIPE_SEQ++;
+		
+		// The reply comes back in the format of the request.
+		if(FRAMED)
+		{
+			framed |= 1 << (portOf(id) - PORT_1);
+		}
+		
+		// Leave room for the slowest module.
+		setRxWindow(id);
+		
+		if(RX_WINDOW > window)
+		{
+			window = RX_WINDOW;
+		}
+		
+		id = nextModule(id);
+	}
+	
+	// Don't wait on a window if there was nobody to ask.
+	count = i;
+	
+	if(!count)
+	{
+		return 0;
+	}
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	// Listen to every port for the replies.
+	CHILD = 0;
+	configToggle(RX_MODE);
+	RX_FRAMED = framed;
+	filterPorts(1);
+	RX_WINDOW = window;
+	
+	while((TIMEOUT < RX_WINDOW) && (answered < count))
+	{
+		// A reply without a sequence number must not pick up the last reply's.
+		PARAM[2] = 0;
+		
+		if(validTransmission())
+		{
+			if((COMMAND_TYPE == PING) && (COMMAND_DESTINATION == PARENT_ID) && (entry = tableEntry(COMMAND_SOURCE)))
+			{
+				slot = PARAM[2] - base;
+				
+				// Modules that don't echo the sequence number only send one reply per request, so
+				// find their request by who it went to.
+				if(!(MODULE_CAPS[entry-1] & CAP_SEQUENCE))
+				{
+					for(slot = 0; (slot < count) && (PIPE_ID[slot] != COMMAND_SOURCE); slot++)
+					{
+						// Keep looking.
+					}
+				}
+				
+				// Take the reply if it answers a request that is still outstanding.
+				if((slot < count) && PIPE_ID[slot] && (PIPE_ID[slot] == COMMAND_SOURCE))
+				{
+					MODULE_TYPE[entry-1] = PARAM[0];
+					MODULE_CHILD[entry-1] = PARAM[1];
+					PIPE_ID[slot] = 0;
+					answered++;
+				}
+			}
+		}
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	// Listen to the first module's port again.
+	selectModule(first);
+	
+	return answered;
+}
+#endif
+
+#if FEATURE_TOPOLOGY_QUERY
+// This function sends the module table to the PC without touching the bus. The reply is the
+// module count, then a comma, the ID, a colon and five characters for each module in the table:
+// its type, the port its child is on, the port of ours that leads to it, and its feature bits as
+// two hex digits. Unknown values are sent as '0'. Modules past the end of the table are counted
+// but not listed.
+void sendTopology(void)
+{
+	char number[5];	// A number written out for the PC.
+	char digit = 0;	// A hex digit of the feature bits.
+	int entry = 0;	// The module's table entry.
+	int i = 0;		// The module being sent.
+	int j = 0;		// An iterator for looping.
+	
+	itoa(number,moduleCount(),10);
+	COMP_SERIAL_PutString(number);
+	
+	for(i = nextModule(0); i && (entry = tableEntry(i)); i = nextModule(i))
+	{
+		COMP_SERIAL_PutChar(',');
+		itoa(number,i,10);
+		COMP_SERIAL_PutString(number);
+		COMP_SERIAL_PutChar(':');
+		
+		if(MODULE_TYPE[entry-1])
+		{
+			COMP_SERIAL_PutChar(MODULE_TYPE[entry-1]);
+		}
+		else
+		{
+			COMP_SERIAL_PutChar('0');
+		}
+		
+		if(MODULE_CHILD[entry-1])
+		{
+			COMP_SERIAL_PutChar(MODULE_CHILD[entry-1]);
+		}
+		else
+		{
+			COMP_SERIAL_PutChar('0');
+		}
+		
+		COMP_SERIAL_PutChar(portOf(i));
+		
+		// The feature bits as two hex digits, high digit first.
+		for(j = 4; j >= 0; j -= 4)
+		{
+			digit = (MODULE_CAPS[entry-1] >> j) & 0x0F;
+			
+			if(digit < 10)
+			{
+				COMP_SERIAL_PutChar('0' + digit);
+			}
+			else
+			{
+				COMP_SERIAL_PutChar('A' + digit - 10);
+			}
+		}
+	}
+	
+	COMP_SERIAL_PutChar('\n');
+}
+#endif
+
+// This function asks every module in the table for its capability descriptor, then works out what
+// each branch can do. Modules that don't answer are left with no features, which holds their whole
+// branch to the original behavior.
+void readCapabilities(void)
+{
+	int i = 0;	// An iterator for looping.
+	
+	for(i = 0; i < TABLE_MODULES; i++)
+	{
+		MODULE_CAPS[i] = 0;
+	}
+	
+	for(i = nextModule(0); i && tableEntry(i); i = nextModule(i))
+	{
+		queryCapabilities(i);
+	}
+	
+	branchCapabilities();
+	
+	// Go back to transmitting on every port.
+	routeTo(0);
+	
+	// Switch back to PC mode.
+	configToggle(PC_MODE);
+}
+
+// This function asks a module for its capability descriptor. The reply parameters are the
+// feature bits, the highest baud rate code the module can run at, and the size of its receive
+// buffer. Only the feature bits are kept, in the table, since nothing changes the baud rate or
+// packet size yet. Returns 1 on success, 0 on fail.
+int queryCapabilities(int module_id)
+{
+	int entry = tableEntry(module_id);	// The module's table entry.
+	
+	// Only talk through the port that leads to the module.
+	selectModule(module_id);
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	// Transmit the capability request.
+	sendCommand(module_id,CAPABILITIES,0,0);
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	// Switch to listening mode.
+	configToggle(RX_MODE);
+	setRxWindow(module_id);
+	
+	// Listen for the response.
+	while(TIMEOUT < RX_WINDOW)
+	{
+		if(validTransmission())
+		{
+			if((COMMAND_TYPE == CAPABILITIES) && (COMMAND_DESTINATION == PARENT_ID) && (COMMAND_SOURCE == module_id))
+			{
+				if(entry)
+				{
+					MODULE_CAPS[entry-1] = PARAM[0];
+				}
+				
+				RX_TIMEOUT_Stop();
+				TIMEOUT = 0;
+				
+				return 1;
+			}
+		}
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	return 0;
+}
+
+// This function works out the feature bits that every module on each branch has. Modules past the
+// end of the table are never asked, so nothing can be counted on for a branch that has any.
+void branchCapabilities(void)
+{
+	int i = 0;		// An iterator for looping.
+	int j = 0;		// The module being looked at.
+	int entry = 0;	// The module's table entry.
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		PORT_CAPS[i] = 0;
+		
+		if(!PORT_COUNT[i])
+		{
+			continue;
+		}
+		
+		PORT_CAPS[i] = 0xFF;
+		
+		for(j = PORT_FIRST[i]; j < (PORT_FIRST[i] + PORT_COUNT[i]); j++)
+		{
+			if(entry = tableEntry(j))
+			{
+				PORT_CAPS[i] &= MODULE_CAPS[entry-1];
+			}
+			else
+			{
+				PORT_CAPS[i] = 0;
+			}
+		}
+	}
+}
+
+
+#if FEATURE_TOPOLOGY_CACHE
+// This function saves the addressing, port table, types and branch features to flash so that the
+// next start up can skip discovery. Only the low byte of each port's first ID is saved, since the high byte is
+// the port's segment with segmented addressing and 0 without it.
+void saveTopology(void)
+{
+	FLASH_WRITE_STRUCT flashWrite;		// The flash write parameters.
+	char block[FLASH_BLOCK_SIZE];		// The block image that gets written to flash.
+	char checksum = 0;					// The sum of the addressing, port table and types.
+	int i = 0;							// An iterator for looping.
+	
+	for(i = 0; i < FLASH_BLOCK_SIZE; i++)
+	{
+		block[i] = 0;
+	}
+	
+	// Copy in the port table and what each branch can do.
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		block[3+i] = PORT_FIRST[i];
+		block[3+NUM_PORTS+i] = PORT_COUNT[i];
+		block[TOPOLOGY_CAPS+i] = PORT_CAPS[i];
+	}
+	
+	// Copy in the types and child ports of the table entries. Child ports are '1' through '4',
+	// so only the low nibble is kept.
+	for(i = 0; i < TABLE_MODULES; i++)
+	{
+		block[TOPOLOGY_HEADER+i] = MODULE_TYPE[i];
+		block[TOPOLOGY_CHILDREN+i/2] |= (MODULE_CHILD[i] & 0x0F) << (4*(i%2));
+	}
+	
+	// Fill in the header.
+	block[0] = TOPOLOGY_MAGIC;
+	block[1] = SEGMENTED ? ADDRESS_SEGMENTED : ADDRESS_FLAT;
+	
+	for(i = 1; i < FLASH_BLOCK_SIZE; i++)
+	{
+		checksum += block[i];
+	}
+	
+	block[2] = checksum;
+	
+	// Write the block.
+	flashWrite.wARG_BlockId = TOPOLOGY_BLOCK;
+	flashWrite.pARG_FlashBuffer = block;
+	flashWrite.cARG_Temperature = FLASH_TEMPERATURE;
+	bFlashWriteBlock(&flashWrite);
+}
+
+// This function loads the module table saved in flash and makes sure that it still describes the
+// robot. The last module on each port must answer with the saved type, and so must one from the
+// middle of the ID range. If anything is off, the table is thrown out and 0 is returned so that
+// discovery runs.
+int loadTopology(void)
+{
+	FLASH_READ_STRUCT flashRead;		// The flash read parameters.
+	char block[FLASH_BLOCK_SIZE];		// The block image read from flash.
+	char checksum = 0;					// The sum of the addressing, port table and types.
+	int i = 0;							// An iterator for looping.
+	int check = 0;						// The ID of the module being checked.
+	int entry = 0;						// A module's table entry.
+	
+	// Read the block.
+	flashRead.wARG_BlockId = TOPOLOGY_BLOCK;
+	flashRead.pARG_FlashBuffer = block;
+	flashRead.wARG_ReadCount = FLASH_BLOCK_SIZE;
+	FlashReadBlock(&flashRead);
+	
+	// If this isn't a module table, there is nothing to load.
+	if((block[0] != TOPOLOGY_MAGIC) || (block[1] == 0))
+	{
+		return 0;
+	}
+	
+	for(i = 1; i < FLASH_BLOCK_SIZE; i++)
+	{
+		if(i != 2)
+		{
+			checksum += block[i];
+		}
+	}
+	
+	if(block[2] != checksum)
+	{
+		return 0;
+	}
+	
+	// A table saved with the other addressing is no use once the PC has switched.
+	if(ADDRESSING && (block[1] != ADDRESSING))
+	{
+		return 0;
+	}
+	
+	// Take on the saved table. The module count is the highest ID on any port.
+	SEGMENTED = (block[1] == ADDRESS_SEGMENTED);
+	NUM_MODULES = 0;
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		PORT_FIRST[i] = block[3+i];
+		PORT_COUNT[i] = block[3+NUM_PORTS+i];
+		PORT_CAPS[i] = block[TOPOLOGY_CAPS+i];
+		
+		if(SEGMENTED && PORT_FIRST[i])
+		{
+			PORT_FIRST[i] |= i << SEGMENT_SHIFT;
+		}
+		
+		if(PORT_COUNT[i] && (NUM_MODULES < (PORT_FIRST[i] + PORT_COUNT[i] - 1)))
+		{
+			NUM_MODULES = PORT_FIRST[i] + PORT_COUNT[i] - 1;
+		}
+	}
+	
+	// A table with no modules in it is what is left when every chain was cut off, so search again.
+	if(!NUM_MODULES)
+	{
+		return 0;
+	}
+	
+	for(i = 0; i < TABLE_MODULES; i++)
+	{
+		MODULE_TYPE[i] = block[TOPOLOGY_HEADER+i];
+		MODULE_CHILD[i] = (block[TOPOLOGY_CHILDREN+i/2] >> (4*(i%2))) & 0x0F;
+		
+		// Modules answer with '0' when they have no child, so put that back too.
+		if(MODULE_TYPE[i])
+		{
+			MODULE_CHILD[i] += '0';
+		}
+		
+		MODULE_CAPS[i] = 0;
+	}
+	
+	// Only the branch features are saved, and every module on the branch has at least those.
+	for(i = nextModule(0); i && (entry = tableEntry(i)); i = nextModule(i))
+	{
+		MODULE_CAPS[entry-1] = PORT_CAPS[portOf(i) - PORT_1];
+	}
+	
+	// Check the last module on each port, then spot check the middle of the ID range.
+	for(i = 0; i <= NUM_PORTS; i++)
+	{
+		if(i < NUM_PORTS)
+		{
+			check = PORT_FIRST[i] + PORT_COUNT[i] - 1;
+		}
+		else
+		{
+			check = (NUM_MODULES+1)/2;
+		}
+		
+		// Skip empty ports and IDs that aren't on any port.
+		if(((i < NUM_PORTS) && !PORT_COUNT[i]) || !portOf(check))
+		{
+			continue;
+		}
+		
+		if(!pingModule(check))
+		{
+			NUM_MODULES = 0;
+		}
+		else if((entry = tableEntry(check)) && (PARAM[0] != MODULE_TYPE[entry-1]))
+		{
+			NUM_MODULES = 0;
+		}
+		
+		if(!NUM_MODULES)
+		{
+			// The robot has changed, so start over from scratch.
+			CHILD = 0;
+			configToggle(PC_MODE);
+			
+			return 0;
+		}
+	}
+	
+	// Listen to the first module's port and transmit on every port until told otherwise.
+	selectModule(1);
+	routeTo(0);
+	
+	// Switch back to PC mode.
+	configToggle(PC_MODE);
+	
+	return 1;
+}
+#endif
+
+#if FEATURE_HEARTBEAT
+// This function sends a hello out of one port while the PC is quiet. Every module we know about
+// already has an ID, so only a module that was just plugged onto the end of a chain can answer.
+// That module gets the next ID and the rest of the robot carries on untouched. The next ID has to
+// stay inside the range of the port it lands on, so only the last port with modules on it and the
+// empty ports after it are probed. Modules added to earlier ports are found at the next start up.
+void probeTail(void)
+{
+	int found = 0;		// Set if a new module took an ID.
+	int last = 0;		// The last port with modules on it.
+	int next = 0;		// The ID the new module gets.
+	int entry = 0;		// A module's table entry.
+	int i = 0;			// An iterator for looping.
+	char number[5];		// The new module count written out for the PC.
+	
+	// Find the last port with modules on it.
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		if(PORT_COUNT[i])
+		{
+			last = i;
+		}
+	}
+	
+	// Take turns probing that port and the ones after it.
+	if((PROBE_PORT < last) || (PROBE_PORT >= NUM_PORTS))
+	{
+		PROBE_PORT = last;
+	}
+	
+	// The new module goes after the highest ID, or at the start of an empty port's segment.
+	next = NUM_MODULES + 1;
+	
+	if(SEGMENTED && !PORT_COUNT[PROBE_PORT])
+	{
+		next = (PROBE_PORT << SEGMENT_SHIFT) + 1;
+	}
+	
+	// If we are maxed out on modules, don't look for more.
+	if((SEGMENTED ? PORT_COUNT[PROBE_PORT] : NUM_MODULES) >= MAX_MODULES)
+	{
+		return;
+	}
+	
+	// Only talk and listen through the port being probed.
+	CHILD = PORT_1 + PROBE_PORT;
+	routeTo(CHILD);
+	
+	// Send out a probing message.
+	sayHello();
+	
+	// Listen for a new module.
+	while(TIMEOUT < RX_WINDOW)
+	{
+		if(validTransmission())
+		{
+			if((COMMAND_TYPE == HELLO_BYTE) && (COMMAND_DESTINATION == PARENT_ID))
+			{
+				// If the assignment wasn't acknowledged, the module may have taken it anyway.
+				if(assignID(next) || pingModule(next))
+				{
+					found = 1;
+				}
+				
+				// Force a timeout to exit the loop.
+				TIMEOUT = RX_WINDOW;
+			}
+		}
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	if(found)
+	{
+		NUM_MODULES = next;
+		
+		// Add the new ID to the port's range.
+		if(!PORT_COUNT[PROBE_PORT])
+		{
+			PORT_FIRST[PROBE_PORT] = NUM_MODULES;
+		}
+		
+		PORT_COUNT[PROBE_PORT]++;
+		
+		// Nothing is known yet about what the new module can do, so talk to its branch in the
+		// original format until it has been asked.
+		PORT_CAPS[PROBE_PORT] = 0;
+		
+		// Only the last port with modules and the ones after it are probed, so the new module's
+		// entry is at the end of the table. Clear out anything left in it.
+		tableRemove(tableEntry(next), 1);
+		
+		// Record what it is and remember it for the next start up.
+		if((entry = tableEntry(next)) && pingModule(next))
+		{
+			MODULE_TYPE[entry-1] = PARAM[0];
+			MODULE_CHILD[entry-1] = PARAM[1];
+		}
+		
+		// The module it was plugged onto now has a child, so ask it which port that is on.
+		if((PORT_COUNT[PROBE_PORT] > 1) && (entry = tableEntry(next - 1)) && pingModule(next - 1))
+		{
+			MODULE_CHILD[entry-1] = PARAM[1];
+		}
+		
+		// Find out what it can do, since it may hold its branch back.
+		if(entry = tableEntry(next))
+		{
+			MODULE_CAPS[entry-1] = 0;
+			queryCapabilities(next);
+		}
+		
+		branchCapabilities();
+		
+		saveTopology();
+	}
+	
+	// Move on to the next port for the next probe.
+	PROBE_PORT++;
+	
+	// Go back to transmitting on every port.
+	routeTo(0);
+	
+	// Switch back to PC mode.
+	configToggle(PC_MODE);
+	
+	if(found)
+	{
+		// Let the PC know that there is a new module.
+		itoa(number,moduleCount(),10);
+		COMP_SERIAL_PutChar(NOTIFY_ADDED);
+		COMP_SERIAL_PutChar(',');
+		COMP_SERIAL_PutString(number);
+		COMP_SERIAL_PutChar('\n');
+	}
+}
+
+// This function makes sure that every port's chain is still there. A ping sweep checks the whole
+// robot at once. If the last module on a port answers it, or a ping after it, that whole chain is
+// there. Otherwise, a binary search with pings finds the first module on that port that no longer
+// answers. Everything past a missing module is cut off from us as well,
+// so the chain is cut short right there. Each ping gets one retry so that a single lost packet
+// doesn't cost us modules. The PC is told the range of IDs that went away. The ports are checked
+// last to first, since cutting a port can move the table entries of the ports after it.
+void checkChain(void)
+{
+	int low = 0;				// Every module below this one answered.
+	int high = 0;				// This module did not answer.
+	int middle = 0;				// The module being pinged.
+	int last = 0;				// The last module on the port.
+	int entry = 0;				// The table entry of the first module cut off.
+	int i = 0;					// An iterator for looping.
+	char number[5];				// An ID written out for the PC.
+#if FEATURE_SWEEP
+	char caps = 0xFF;			// The features every branch has.
+	
+	// Find the features that every branch has.
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		if(PORT_COUNT[i])
+		{
+			caps &= PORT_CAPS[i];
+		}
+	}
+	
+	// Check on everyone in one window, if everyone knows how to answer.
+	if(caps & CAP_SWEEP)
+	{
+		pingSweep();
+	}
+	else
+#endif
+	{
+		for(i = 0; i < TABLE_BYTES; i++)
+		{
+			LIVE[i] = 0;
+		}
+	}
+	
+	for(i = NUM_PORTS - 1; i >= 0; i--)
+	{
+		if(!PORT_COUNT[i])
+		{
+			continue;
+		}
+		
+		low = PORT_FIRST[i];
+		last = PORT_FIRST[i] + PORT_COUNT[i] - 1;
+		high = last;
+		
+		// If the last module answers, the whole chain is there.
+		if(isLive(last) || pingModule(last) || pingModule(last))
+		{
+			continue;
+		}
+		
+		// Narrow in on the first module that doesn't answer.
+		while(low < high)
+		{
+			middle = (low + high)/2;
+			
+			if(pingModule(middle) || pingModule(middle))
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		
+		// Cut the chain off, and forget what we knew about the modules that are gone.
+		entry = tableEntry(high);
+		PORT_COUNT[i] = high - PORT_FIRST[i];
+		tableRemove(entry, last - high + 1);
+		branchCapabilities();
+		
+		// The module count is the highest ID still in use.
+		NUM_MODULES = 0;
+		
+		for(middle = 0; middle < NUM_PORTS; middle++)
+		{
+			if(PORT_COUNT[middle])
+			{
+				NUM_MODULES = PORT_FIRST[middle] + PORT_COUNT[middle] - 1;
+			}
+		}
+		
+		// Remember it for the next start up.
+		saveTopology();
+		
+		// Switch back to PC mode.
+		configToggle(PC_MODE);
+		
+		// Let the PC know which modules are gone.
+		COMP_SERIAL_PutChar(NOTIFY_REMOVED);
+		COMP_SERIAL_PutChar(',');
+		itoa(number,high,10);
+		COMP_SERIAL_PutString(number);
+		COMP_SERIAL_PutChar(',');
+		itoa(number,last,10);
+		COMP_SERIAL_PutString(number);
+		COMP_SERIAL_PutChar('\n');
+	}
+	
+	// Go back to transmitting on every port.
+	routeTo(0);
+	
+	// Switch back to PC mode.
+	configToggle(PC_MODE);
+}
+#endif
+
+#if FEATURE_BULK
+// This function starts a bulk transfer to a module, or to every module if passed BROADCAST. Chunks
+// carry any byte value, so everyone who will hear the transfer has to support both the framing
+// mode and bulk transfers. Returns 1 if the transfer can go ahead, 0 if not. Only a transfer that
+// can go ahead is opened for U,D and U,E.
+int bulkStart(int destination)
+{
+	BULK_DESTINATION = destination;
+	BULK_BASE = 0;
+	BULK_COUNT = 0;
+	BULK_FILL = 0;
+	BULK_ACKED = 0;
+	BULK_STALLS = 0;
+	BULK_ACTIVE = 0;
+	
+	if(destination == BROADCAST)
+	{
+		routeTo(0);
+	}
+	else if(portOf(destination))
+	{
+		selectModule(destination);
+	}
+	else
+	{
+		return 0;
+	}
+	
+	BULK_ACTIVE = FRAMED && (ROUTE_CAPS & CAP_BULK);
+	
+	return BULK_ACTIVE;
+}
+
+// This function adds the bytes written out in a hex string to the bulk transfer. Bytes are packed
+// into chunks, and a chunk is ready to send once it is full. Nothing is added unless all of the
+// bytes fit in the window. Returns 1 if they were added, 0 if not.
+int bulkAdd(char* hex)
+{
+	int bytes = 0;	// The number of bytes in the string.
+	int i = 0;		// An iterator for looping.
+	
+	while(hex[bytes*2] && hex[bytes*2+1])
+	{
+		bytes++;
+	}
+	
+	if(bytes > (((BULK_WINDOW - BULK_COUNT) * BULK_CHUNK) - BULK_FILL))
+	{
+		return 0;
+	}
+	
+	for(i = 0; i < bytes; i++)
+	{
+		BULK_BUFFER[BULK_COUNT][BULK_FILL] = (hexValue(hex[i*2]) << 4) | hexValue(hex[i*2+1]);
+		BULK_FILL++;
+		
+		// Close the chunk once it is full.
+		if(BULK_FILL == BULK_CHUNK)
+		{
+			BULK_LENGTH[BULK_COUNT] = BULK_CHUNK;
+			BULK_COUNT++;
+			BULK_FILL = 0;
+		}
+	}
+	
+	return 1;
+}
+
+// This function runs one round of a bulk transfer. Every chunk in the window that hasn't been
+// acknowledged goes out back to back, each with its sequence number. Then the receivers answer
+// with the next sequence number they are waiting for, which acknowledges everything before it,
+// and a bitmap of the chunks they already have past that one. Only the chunks that are still
+// missing get sent in the next round. When the transfer is a broadcast, every module that takes
+// part answers in its own ping sweep slot, and a chunk only counts as acknowledged once all of
+// them have it. Each module is only counted once, however many times it answers. Acknowledged
+// chunks at the front of the window are then slid out of it. If the route can no longer carry the
+// transfer, it is closed instead.
+void bulkRound(void)
+{
+	char params[FRAME_MAX_PARAMS];	// The sequence number and data of a chunk.
+	char answered[TABLE_BYTES];		// Which modules have answered, one bit per table entry.
+	char acked = 0;					// The chunks everyone who answered has.
+	char heard = 0;					// The number of modules that answered.
+	char expected = 1;				// The number of modules that should answer.
+	char offset = 0;				// Where a chunk falls relative to an acknowledgement.
+	int entry = 0;					// A module's table entry.
+	int i = 0;						// An iterator for looping.
+	int j = 0;						// An iterator for looping.
+	
+	if(!BULK_COUNT)
+	{
+		return;
+	}
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	if(BULK_DESTINATION == BROADCAST)
+	{
+		routeTo(0);
+	}
+	else
+	{
+		selectModule(BULK_DESTINATION);
+	}
+	
+	// Chunks are only safe to send framed, to modules that take part in bulk transfers.
+	if(!(FRAMED && (ROUTE_CAPS & CAP_BULK)))
+	{
+		BULK_ACTIVE = 0;
+		
+		return;
+	}
+	
+	for(i = 0; i < TABLE_BYTES; i++)
+	{
+		answered[i] = 0;
+	}
+	
+	// Send every chunk that is still missing.
+	for(i = 0; i < BULK_COUNT; i++)
+	{
+		if(!(BULK_ACKED & (1 << i)))
+		{
+			params[0] = BULK_BASE + i;
+			
+			for(j = 0; j < BULK_LENGTH[i]; j++)
+			{
+				params[j+1] = BULK_BUFFER[i][j];
+			}
+			
+			sendParams(BULK_DESTINATION,BULK_DATA,BULK_LENGTH[i]+1,params);
+		}
+	}
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	// Switch to listening mode.
+	if(BULK_DESTINATION == BROADCAST)
+	{
+		// Listen to every port, and leave room for every slot.
+		CHILD = 0;
+		configToggle(RX_MODE);
+		RX_WINDOW = (sweepSlots() * SWEEP_SLOT) + RX_TIMEOUT_DURATION;
+		
+		expected = 0;
+		
+		for(i = nextModule(0); i && (entry = tableEntry(i)); i = nextModule(i))
+		{
+			if(MODULE_CAPS[entry-1] & CAP_BULK)
+			{
+				expected++;
+			}
+		}
+	}
+	else
+	{
+		configToggle(RX_MODE);
+		setRxWindow(BULK_DESTINATION);
+	}
+	
+	acked = 0xFF;
+	
+	while((TIMEOUT < RX_WINDOW) && (heard < expected))
+	{
+		if(validTransmission())
+		{
+			if((COMMAND_TYPE == BULK_ACK) && (COMMAND_DESTINATION == PARENT_ID))
+			{
+				// Only count modules that are expected to answer, and only once each.
+				if(BULK_DESTINATION != BROADCAST)
+				{
+					j = (COMMAND_SOURCE == BULK_DESTINATION);
+				}
+				else if(portOf(COMMAND_SOURCE) && (entry = tableEntry(COMMAND_SOURCE)) && (MODULE_CAPS[entry-1] & CAP_BULK))
+				{
+					j = !(answered[(entry-1)/8] & (1 << ((entry-1)%8)));
+					answered[(entry-1)/8] |= (1 << ((entry-1)%8));
+				}
+				else
+				{
+					j = 0;
+				}
+				
+				if(j)
+				{
+					heard++;
+					
+					// Work out which chunks in the window this module has.
+					j = 0;
+					
+					for(i = 0; i < BULK_COUNT; i++)
+					{
+						offset = (BULK_BASE + i) - PARAM[0];
+						
+						if((offset >= 128) || ((offset >= 1) && (offset <= 8) && (PARAM[1] & (1 << (offset-1)))))
+						{
+							j |= (1 << i);
+						}
+					}
+					
+					acked &= j;
+				}
+			}
+		}
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	// Anyone who didn't answer can't be counted on to have anything.
+	if(heard < expected)
+	{
+		acked = 0;
+	}
+	
+	acked &= (1 << BULK_COUNT) - 1;
+	
+	// Keep track of whether we are getting anywhere.
+	if(acked & ~BULK_ACKED & ((1 << BULK_COUNT) - 1))
+	{
+		BULK_STALLS = 0;
+	}
+	else
+	{
+		BULK_STALLS++;
+	}
+	
+	BULK_ACKED |= acked;
+	
+	// Slide the window past the chunks at the front that everyone has.
+	while(BULK_COUNT && (BULK_ACKED & 1))
+	{
+		for(i = 1; i <= BULK_COUNT; i++)
+		{
+			BULK_LENGTH[i-1] = BULK_LENGTH[i % BULK_WINDOW];
+			
+			for(j = 0; j < BULK_CHUNK; j++)
+			{
+				BULK_BUFFER[i-1][j] = BULK_BUFFER[i % BULK_WINDOW][j];
+			}
+		}
+		
+		BULK_ACKED >>= 1;
+		BULK_BASE++;
+		BULK_COUNT--;
+	}
+}
+
+// This function sends whatever is left of a bulk transfer and tells the receivers that it is over,
+// with the total number of chunks. Returns 1 on success, or 0 if no transfer was open or the
+// receivers stopped making progress before everything was acknowledged. Either way the transfer
+// is closed.
+int bulkFinish(void)
+{
+	// There is nothing to finish unless U,S opened a transfer.
+	if(!BULK_ACTIVE)
+	{
+		return 0;
+	}
+	
+	// Close the last chunk, even if it isn't full.
+	if(BULK_FILL)
+	{
+		BULK_LENGTH[BULK_COUNT] = BULK_FILL;
+		BULK_COUNT++;
+		BULK_FILL = 0;
+	}
+	
+	BULK_STALLS = 0;
+	
+	while(BULK_ACTIVE && BULK_COUNT && (BULK_STALLS < BULK_RETRIES))
+	{
+		bulkRound();
+	}
+	
+	if(!BULK_ACTIVE || BULK_COUNT)
+	{
+		BULK_ACTIVE = 0;
+		
+		return 0;
+	}
+	
+	BULK_ACTIVE = 0;
+	
+	// Toggle into PC mode and let everyone know that the transfer is done.
+	configToggle(PC_MODE);
+	sendCommand(BULK_DESTINATION,BULK_END,1,BULK_BASE);
+	xmitWait();
+	
+	return 1;
+}
+#endif
+
+#if FEATURE_TIME
+// This function resets the clock of every module at once. Modules start a command whenever they
+// happen to hear it, and every repeater on the way adds its delay, so the sync has to tell each
+// module how long ago it was sent. The delay per hop on each port is worked out from the round
+// trip times to the first and last modules on it, which leaves out the time the modules take to
+// answer, and is sent in 1/RTT_SCALE ms units along with the first ID on each port. A module on
+// a port sets its clock to (ID - first ID + 1) hops worth of delay, so that every clock reads 0
+// at the moment the sync left the master. Both are sent plus TIME_OFFSET. Round trip times are
+// only kept for modules with table entries, so a branch that runs past the end of the table is
+// timed up to its last module that has one. The sync fails if a branch has no module with an
+// entry, or if a first ID can't be sent in the original format.
+int timeSync(void)
+{
+	char params[2*NUM_PORTS];	// The first ID, then the hop delay, of each port.
+	int first = 0;				// The first module on a port.
+	int last = 0;				// The last module on a port with a table entry.
+	int hop = 0;				// The one way delay of each hop on a port.
+	int near = 0;				// The table entry of the first module on a port.
+	int far = 0;				// The table entry of the last module on a port.
+	char framed = 0;			// Set if the sync will be framed.
+	int i = 0;					// An iterator for looping.
+	
+	// Every module gets the sync, so it goes out of every port at once.
+	routeTo(0);
+	framed = FRAMED;
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		first = PORT_FIRST[i];
+		last = PORT_FIRST[i] + PORT_COUNT[i] - 1;
+		hop = 0;
+		
+		if(PORT_COUNT[i])
+		{
+			if(!(near = tableEntry(first)) || (!framed && ((wireID(first) + TIME_OFFSET) > TIME_PARAM_MAX)))
+			{
+				return 0;
+			}
+			
+			while(!(far = tableEntry(last)))
+			{
+				last--;
+			}
+			
+			// Get fresh round trip times for both ends of the branch.
+			pingModule(first);
+			
+			if(last != first)
+			{
+				pingModule(last);
+			}
+			
+			if(RTT_AVERAGE[near-1] && RTT_AVERAGE[far-1] && (RTT_AVERAGE[far-1] > RTT_AVERAGE[near-1]))
+			{
+				hop = (RTT_AVERAGE[far-1] - RTT_AVERAGE[near-1])/(2*(last - first));
+			}
+			else if(RTT_AVERAGE[near-1])
+			{
+				// With one module, or nothing to go on, count the whole trip as hop delay.
+				hop = RTT_AVERAGE[near-1]/2;
+			}
+		}
+		
+		params[i] = wireID(first) + TIME_OFFSET;
+		params[NUM_PORTS+i] = hop + TIME_OFFSET;
+	}
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	// The pings above moved the route, so point it at every port again.
+	routeTo(0);
+	sendParams(BROADCAST,TIME_SYNC,2*NUM_PORTS,params);
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	return 1;
+}
+
+// This function tells a module, or every module if passed BROADCAST, to hold the next command it
+// is sent until its clock reaches the tick. Arming every module and then sending a broadcast or
+// group write makes every servo move on the same tick.
+void timeArm(int destination, int tick)
+{
+	char params[2];		// The tick, in two 7 bit halves.
+	
+	params[0] = ((tick >> 7) & 0x7F) + TIME_OFFSET;
+	params[1] = (tick & 0x7F) + TIME_OFFSET;
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	if(destination == BROADCAST)
+	{
+		routeTo(0);
+	}
+	else
+	{
+		selectModule(destination);
+	}
+	
+	sendParams(destination,TIME_ARM,2,params);
+	
+	// Make completely sure we're done.
+	xmitWait();
+}
+#endif
+
+// This function returns the ID a module answers to. With segmented addressing that is the low
+// byte of its address, since the port it is on already picks out its segment. Otherwise it is the
+// whole ID. Either way it fits in the one byte that packets have for it.
+char wireID(int module_id)
+{
+	return module_id & 0xFF;
+}
+
+#if FEATURE_SWEEP || FEATURE_EVENTS || FEATURE_BULK
+// This function returns the number of slots a ping sweep has to leave room for. Modules answer in
+// the slot of the ID they answer to, so with segmented addressing the ports answer side by side
+// and only the longest one counts.
+int sweepSlots(void)
+{
+	int slots = 0;	// The most IDs on any one port.
+	int i = 0;		// An iterator for looping.
+	
+	if(!SEGMENTED)
+	{
+		return NUM_MODULES;
+	}
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		if(PORT_COUNT[i] > slots)
+		{
+			slots = PORT_COUNT[i];
+		}
+	}
+	
+	return slots;
+}
+#endif
+
+#if FEATURE_EVENTS
+// This function opens a gap on the bus for modules to report events, like an overloaded or hot
+// servo or something being plugged into a port, so that the PC doesn't have to keep polling for
+// them. The gap works like a ping sweep, but only modules that have something to report answer,
+// so a quiet robot costs one short broadcast. The reports are picked up by validTransmission.
+void eventWindow(void)
+{
+	char child = CHILD;		// The port that was being listened to.
+	int last = 0;			// The last slot that a module which reports events answers in.
+	int entry = 0;			// A module's table entry.
+	int i = 0;				// An iterator for looping.
+	
+	// Modules answer in the slot of the ID they answer to. Only modules in the table are known to
+	// report events.
+	for(i = nextModule(0); i && (entry = tableEntry(i)); i = nextModule(i))
+	{
+		if((MODULE_CAPS[entry-1] & CAP_EVENTS) && (wireID(i) > last))
+		{
+			last = wireID(i);
+		}
+	}
+	
+	// Don't bother if nobody can report anything.
+	if(!last)
+	{
+		return;
+	}
+	
+	// Talk and listen through every port.
+	CHILD = 0;
+	routeTo(0);
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	// Open the window with the slot width.
+	sendCommand(BROADCAST,EVENT_WINDOW,1,SWEEP_SLOT);
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	// Switch to listening mode, and leave room for every slot up to the last one.
+	configToggle(RX_MODE);
+	RX_WINDOW = (last * SWEEP_SLOT) + RX_TIMEOUT_DURATION;
+	
+	// Anything other than an event is left alone.
+	while(TIMEOUT < RX_WINDOW)
+	{
+		validTransmission();
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	// Go back to the port we were listening to.
+	CHILD = child;
+	
+	// Toggle back into PC mode so the events can go out.
+	configToggle(PC_MODE);
+}
+
+// This function stores the event report that was just read, unless the queue is full. Something
+// being plugged in also moves the next tail probe up, so a new module is found right away.
+void queueEvent(void)
+{
+	if(EVENT_COUNT < EVENT_SLOTS)
+	{
+		EVENT_SOURCE[EVENT_COUNT] = COMMAND_SOURCE;
+		EVENT_QUEUE[EVENT_COUNT][0] = PARAM[0];
+		EVENT_QUEUE[EVENT_COUNT][1] = PARAM[1];
+		EVENT_COUNT++;
+	}
+	else if(EVENT_LOST < 255)
+	{
+		EVENT_LOST++;
+	}
+	
+#if FEATURE_HEARTBEAT
+	if(PARAM[0] == EVENT_PLUGGED)
+	{
+		PROBE_TURN = 0;
+		IDLE_COUNT = PROBE_INTERVAL;
+	}
+#endif
+}
+
+// This function sends each waiting event to the PC as E,<id>,<code>,<value>. If any had to be
+// dropped, that is sent after them as E,0,0,<number dropped>.
+void sendEvents(void)
+{
+	char digits[5];		// Stores a number converted to text.
+	int i = 0;			// An iterator for looping.
+	
+	if(STATE != PC_MODE)
+	{
+		configToggle(PC_MODE);
+	}
+	
+	for(i = 0; i < EVENT_COUNT; i++)
+	{
+		COMP_SERIAL_PutChar(NOTIFY_EVENT);
+		COMP_SERIAL_PutChar(',');
+		itoa(digits,EVENT_SOURCE[i],10);
+		COMP_SERIAL_PutString(digits);
+		COMP_SERIAL_PutChar(',');
+		itoa(digits,EVENT_QUEUE[i][0],10);
+		COMP_SERIAL_PutString(digits);
+		COMP_SERIAL_PutChar(',');
+		itoa(digits,EVENT_QUEUE[i][1],10);
+		COMP_SERIAL_PutString(digits);
+		COMP_SERIAL_PutChar('\n');
+	}
+	
+	if(EVENT_LOST)
+	{
+		COMP_SERIAL_PutChar(NOTIFY_EVENT);
+		COMP_SERIAL_PutChar(',');
+		COMP_SERIAL_PutChar('0');
+		COMP_SERIAL_PutChar(',');
+		COMP_SERIAL_PutChar('0');
+		COMP_SERIAL_PutChar(',');
+		itoa(digits,EVENT_LOST,10);
+		COMP_SERIAL_PutString(digits);
+		COMP_SERIAL_PutChar('\n');
+	}
+	
+	EVENT_COUNT = 0;
+	EVENT_LOST = 0;
+}
+#endif
+
+#if FEATURE_BULK
+// This function converts a hex digit to its value. Anything that isn't a hex digit is 0.
+char hexValue(char digit)
+{
+	if((digit >= '0') && (digit <= '9'))
+	{
+		return digit - '0';
+	}
+	else if((digit >= 'a') && (digit <= 'f'))
+	{
+		return digit - 'a' + 10;
+	}
+	else if((digit >= 'A') && (digit <= 'F'))
+	{
+		return digit - 'A' + 10;
+	}
+	
+	return 0;
+}
+#endif
+
+#if FEATURE_SWEEP
+// This function pings every module with a single broadcast. Each module waits SWEEP_SLOT ms for
+// every ID below its own before it answers, so the answers come back one after another instead of
+// on top of each other. All ports are listened to at once, and every module that answers gets the
+// bit of its table entry set in LIVE. Modules past the end of the table can't be recorded, so they
+// are left to pingModule. Returns the number of modules that answered.
+int pingSweep(void)
+{
+	int live = 0;			// The number of modules that answered.
+	char child = CHILD;		// The port that was being listened to.
+	int entry = 0;			// The table entry of a module that answered.
+	int i = 0;				// An iterator for looping.
+	
+	for(i = 0; i < TABLE_BYTES; i++)
+	{
+		LIVE[i] = 0;
+	}
+	
+	// Talk and listen through every port.
+	CHILD = 0;
+	routeTo(0);
+	
+	// Toggle into PC mode.
+	configToggle(PC_MODE);
+	
+	// Transmit the sweep with the slot width.
+	sendCommand(BROADCAST,PING_SWEEP,1,SWEEP_SLOT);
+	
+	// Make completely sure we're done.
+	xmitWait();
+	
+	// Switch to listening mode, and leave room for every slot.
+	configToggle(RX_MODE);
+	RX_WINDOW = (sweepSlots() * SWEEP_SLOT) + RX_TIMEOUT_DURATION;
+	
+	// Collect the answers until the last slot has passed.
+	while(TIMEOUT < RX_WINDOW)
+	{
+		if(validTransmission())
+		{
+			if((COMMAND_TYPE == PING) && (COMMAND_DESTINATION == PARENT_ID))
+			{
+				if((entry = tableEntry(COMMAND_SOURCE)) && !isLive(COMMAND_SOURCE))
+				{
+					LIVE[(entry-1)/8] |= (1 << ((entry-1)%8));
+					live++;
+				}
+			}
+		}
+	}
+	
+	RX_TIMEOUT_Stop();
+	TIMEOUT = 0;
+	
+	// Go back to the port we were listening to.
+	CHILD = child;
+	
+	return live;
+}
+#endif
+
+// This function finds out which modules in the table answer. The sweep only goes out if a branch
+// can answer it, and the modules on branches that can't are pinged one at a time instead. Their
+// answers go in LIVE along with the sweep's. Returns the number of modules that answered.
+int checkLive(void)
+{
+	int live = 0;		// The number of modules that answered.
+	char sweep = 0;		// Set if any branch answers ping sweeps.
+	int entry = 0;		// A module's table entry.
+	int i = 0;			// An iterator for looping.
+	
+#if FEATURE_SWEEP
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		if(PORT_COUNT[i] && (PORT_CAPS[i] & CAP_SWEEP))
+		{
+			sweep = 1;
+		}
+	}
+	
+	if(sweep)
+	{
+		live = pingSweep();
+	}
+	else
+#endif
+	{
+		for(i = 0; i < TABLE_BYTES; i++)
+		{
+			LIVE[i] = 0;
+		}
+	}
+	
+	for(i = nextModule(0); i && (entry = tableEntry(i)); i = nextModule(i))
+	{
+		if(!(sweep && (PORT_CAPS[portOf(i) - PORT_1] & CAP_SWEEP)) && pingModule(i))
+		{
+			LIVE[(entry-1)/8] |= (1 << ((entry-1)%8));
+			live++;
+		}
+	}
+	
+	return live;
+}
+
+// This function returns 1 if a module answered the last ping sweep, and 0 if it didn't or if it
+// doesn't have a table entry.
+int isLive(int module_id)
+{
+	int entry = tableEntry(module_id);	// The module's table entry.
+	
+	if(!entry)
+	{
+		return 0;
+	}
+	
+	return (LIVE[(entry-1)/8] >> ((entry-1)%8)) & 1;
+}
+
+// This function listens for a child on the port being probed. Only non-blocking reads are used
+// to avoid getting stuck listening downstream. Returns 1 if a child answered, 0 if not.
+int childListen(void)
+{
+	int found = 0;	// Set if a child answered.
+	
+	// Wait to either hear a child or time out.
+	while(TIMEOUT < RX_WINDOW)
+	{
+		if(iReadChar() == START_TRANSMIT)
+		{
+			while(TIMEOUT < RX_WINDOW)
+			{
+				if(iReadChar() == END_TRANSMIT)
+				{
+					found = 1;
+				}
+			}
+		}
+	}
+	
+	return found;
+}
+
+// This function returns the port that leads to a module, or 0 if the module isn't in any port's
+// range of IDs.
+char portOf(int module_id)
+{
+	int i = 0;	// An iterator for looping.
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		if(PORT_COUNT[i] && (module_id >= PORT_FIRST[i]) && (module_id < (PORT_FIRST[i] + PORT_COUNT[i])))
+		{
+			return PORT_1 + i;
+		}
+	}
+	
+	return 0;
+}
+
+// This function returns the number of modules in the port table. With segmented addressing this
+// is less than NUM_MODULES, which is the highest ID, so this is what the PC is told.
+int moduleCount(void)
+{
+	int count = 0;	// The number of modules counted so far.
+	int i = 0;		// An iterator for looping.
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		count += PORT_COUNT[i];
+	}
+	
+	return count;
+}
+
+// This function returns where a module's entry is in the per-module tables, counting from 1, or 0
+// if it doesn't have one. Without segmented addressing the entry is the ID. With it, the modules of
+// each port are packed into the table one port after another, so that every segment gets entries
+// and not only the first. Either way, only the first TABLE_MODULES modules have one.
+int tableEntry(int module_id)
+{
+	int entry = module_id;	// The module's table entry.
+	int i = 0;				// An iterator for looping.
+	
+	if(SEGMENTED)
+	{
+		if(!portOf(module_id))
+		{
+			return 0;
+		}
+		
+		entry = wireID(module_id);
+		
+		for(i = 0; i < (module_id >> SEGMENT_SHIFT); i++)
+		{
+			entry += PORT_COUNT[i];
+		}
+	}
+	
+	if((entry < 1) || (entry > TABLE_MODULES))
+	{
+		return 0;
+	}
+	
+	return entry;
+}
+
+// This function returns the module after the one passed, in port table order, or 0 if it was the
+// last one. Passing 0 returns the first module. The ports hand out IDs in port order, so this is
+// also ID order, and IDs that aren't on any port, like the gaps between segments, are skipped.
+int nextModule(int module_id)
+{
+	int i = 0;	// An iterator for looping.
+	
+	for(i = 0; i < NUM_PORTS; i++)
+	{
+		if(PORT_COUNT[i])
+		{
+			if(module_id < PORT_FIRST[i])
+			{
+				return PORT_FIRST[i];
+			}
+			
+			if(module_id < (PORT_FIRST[i] + PORT_COUNT[i] - 1))
+			{
+				return module_id + 1;
+			}
+		}
+	}
+	
+	return 0;
+}
+
+// This function clears the table entries of a run of modules that were cut off, starting at the
+// entry passed. With segmented addressing, the entries of the later ports are moved down over them
+// instead, since each port's entries are packed in right after the port before it.
+void tableRemove(int entry, int count)
+{
+	int i = 0;	// An iterator for looping.
+	int j = 0;	// The entry that moves down into this one.
+	
+	if(!entry)
+	{
+		return;
+	}
+	
+	for(i = entry - 1; i < TABLE_MODULES; i++)
+	{
+		j = i + count;
+		
+		if(SEGMENTED && (j < TABLE_MODULES))
+		{
+			MODULE_TYPE[i] = MODULE_TYPE[j];
+			MODULE_CHILD[i] = MODULE_CHILD[j];
+			MODULE_CAPS[i] = MODULE_CAPS[j];
+			RTT_AVERAGE[i] = RTT_AVERAGE[j];
+			RTT_DEVIATION[i] = RTT_DEVIATION[j];
+		}
+		else if(SEGMENTED || (i < (entry - 1 + count)))
+		{
+			MODULE_TYPE[i] = 0;
+			MODULE_CHILD[i] = 0;
+			MODULE_CAPS[i] = 0;
+			RTT_AVERAGE[i] = 0;
+			RTT_DEVIATION[i] = 0;
+		}
+	}
+}
+
+// This function picks which ports our transmissions go out of. Passing a port sends only out of
+// that one, and passing 0 sends out of all of them. If we are already transmitting, the change
+// is made right away. CRC framing is used if it is turned on and the branches we are talking to
+// all support it.
+void routeTo(char port)
+{
+	char caps = 0xFF;	// The features every module we are talking to has.
+	int i = 0;			// An iterator for looping.
+	
+	if(port)
+	{
+		ROUTE = 1 << (port - '0');
+		caps = PORT_CAPS[port - PORT_1];
+	}
+	else
+	{
+		ROUTE = PORT_PINS;
+		
+		for(i = 0; i < NUM_PORTS; i++)
+		{
+			if(PORT_COUNT[i])
+			{
+				caps &= PORT_CAPS[i];
+			}
+		}
+	}
+	
+	// Only frame transmissions if everyone who will hear them understands frames.
+	ROUTE_CAPS = caps;
+#if FEATURE_FRAMING
+	FRAMED = FRAMING && (caps & CAP_FRAMING) && NUM_MODULES;
+#endif
+	
+	if(STATE == PC_MODE)
+	{
+		PRT0GS = (~PORT_PINS | ROUTE);
+	}
+}
+
+// This function points the receiver and the transmit route at the port that leads to a module.
+// Broadcasts go out of every port. Modules that aren't in the port table yet, which only happens
+// during discovery, leave the route alone.
+void selectModule(int module_id)
+{
+	char port = 0;	// The port that leads to the module.
+	
+	if(module_id == BROADCAST)
+	{
+		routeTo(0);
+	}
+	else if(port = portOf(module_id))
+	{
+		CHILD = port;
+		routeTo(port);
+	}
+}
+
+// This function converts the PSoC cReadChar calls of all ports into a single return.
+char iReadChar(void)
+{
+	int tempByte = iReadByte();	// The byte and its port status.
+	
+	// Like cReadChar, return 0 if there is no data or it is bad.
+	if(tempByte & 0xFF00)
+	{
+		return 0;
+	}
+	
+	return tempByte;
+}
+
+// This function converts the PSoC cGetChar calls of all ports into a single return.
+char readChar(void)
+{
+	int tempByte = 0;	// The byte and its port status.
+	
+	// If there is no child port, there is nothing to wait for.
+	if(!CHILD)
+	{
+		return 0;
+	}
+	
+	// Wait until the port has something for us.
+	do
+	{
+		tempByte = iReadByte();
+	} while(tempByte & (RECEIVE_1_RX_NO_DATA << 8));
+	
+	return tempByte;
+}
+
+// This function reads the next byte from the child port out of the receive ring, the same way the
+// PSoC iReadChar calls do. The upper byte holds the status, so a zero data byte can be told apart
+// from no data. The port the byte came in on is left in RX_PORT.
+int iReadByte(void)
+{
+	int tempByte = (RECEIVE_1_RX_NO_DATA << 8);	// The byte and its port status.
+	char port = 0;								// The port of the byte at the tail of the ring.
+	
+	// Take bytes off of the ring until one from the child port turns up or the ring runs dry.
+	while((tempByte & 0xFF00) && (RING_TAIL != RING_HEAD))
+	{
+		port = RING_PORT[RING_TAIL];
+		
+#if FEATURE_SNIFFER
+		// The sniffer sees every byte before it leaves the ring, unless it already has.
+		if(RING_SNIFF == RING_TAIL)
+		{
+			if(SNIFF)
+			{
+				sniffByte(port - '0', RING_DATA[RING_TAIL], RING_TIME[RING_TAIL]);
+			}
+			
+			RING_SNIFF = (RING_SNIFF + 1) & RING_MASK;
+		}
+		
+#endif
+		// Only the child port is being listened to, or every port if there is no child port set.
+		if(!CHILD || (port == CHILD))
+		{
+			tempByte = RING_DATA[RING_TAIL];
+			RX_PORT = port;
+		}
+		
+		RING_TAIL = (RING_TAIL + 1) & RING_MASK;
+	}
+	
+	return tempByte;
+}
+
+// This function turns the address filter in the receive interrupts on or off. While it is on, the
+// interrupts keep transmissions for other modules out of the ring, so they don't take up ring space
+// or main loop time. The filter only knows the original format, so ports whose replies are framed
+// are never filtered, and neither is anything while the sniffer is on, since it has to see every
+// byte. Every port's filter starts over.
+void filterPorts(char on)
+{
+	int i = 0;	// An iterator for looping.
+	
+	for(i = 0; i < NUM_PORTS; i++)
 	{
-		return RECEIVE_1_cReadChar();
+		FILTER_STATE[i] = FILTER_OFF;
+		
+		if(on && !SNIFF && !((RX_FRAMED >> i) & 1))
+		{
+			FILTER_STATE[i] = FILTER_PASS;
+		}
 	}
-	else if(CHILD == PORT_2)
+}
+
+// This function sends a command to the modules, with one parameter if count is 1.
+void sendCommand(int destination, char type, char count, char param)
+{
+	sendParams(destination, type, count, &param);
+}
+
+// This function sends a command with any number of parameters, up to FRAME_MAX_PARAMS. In the
+// original format the command is wrapped in start and end bytes, and no parameter can be a start
+// or end byte. In the framing mode it is wrapped in flag bytes with a length and a CRC-8, and
+// stuffed so that any byte value can be sent, like bulk transfer chunks. With segmented
+// addressing, the destination goes out as the ID the module answers to on its own port.
+void sendParams(int destination, char type, char count, char* params)
+{
+#if FEATURE_FRAMING
+	char crc = 0;	// The CRC of the frame so far.
+#endif
+	int i = 0;		// An iterator for looping.
+	
+#if FEATURE_FRAMING
+	if(FRAMED)
 	{
-		return RECEIVE_2_cReadChar();
+		busPutChar(FRAME_FLAG);						// Start of the frame
+		crc = framePutChar(crc, PARENT_ID);			// My ID
+		crc = framePutChar(crc, wireID(destination));	// Destination ID
+		crc = framePutChar(crc, type);				// The command type
+		crc = framePutChar(crc, count);				// The number of parameters
+		
+		for(i = 0; i < count; i++)
+		{
+			crc = framePutChar(crc, params[i]);		// The parameters
+		}
+		
+		framePutChar(crc, crc);						// The CRC of the frame
+		busPutChar(FRAME_FLAG);						// End of the frame
 	}
-	else if(CHILD == PORT_3)
+	else
+#endif
 	{
-		return RECEIVE_3_cReadChar();
+		busPutChar(START_TRANSMIT);		// Start byte one
+		busPutChar(START_TRANSMIT);		// Start byte two
+		busPutChar(PARENT_ID);			// My ID
+		busPutChar(wireID(destination));	// Destination ID
+		busPutChar(type);				// The command type
+		
+		for(i = 0; i < count; i++)
+		{
+			busPutChar(params[i]);		// The parameters
+		}
+		
+		busPutChar(END_TRANSMIT);		// This is the end of this transmission
+		busPutChar(END_TRANSMIT);		// This is the end of this transmission
 	}
-	else if(CHILD == PORT_4)
+	
+	// Wait for the transmission to finish.
+	busWait();
+}
+
+#if FEATURE_FRAMING
+// This function sends one byte of a frame, stuffing it if it looks like a flag or escape byte,
+// and returns the CRC with the byte folded in.
+char framePutChar(char crc, char value)
+{
+	if((value == FRAME_FLAG) || (value == FRAME_ESCAPE))
 	{
-		return RECEIVE_4_cReadChar();
+		busPutChar(FRAME_ESCAPE);
+		busPutChar(value ^ FRAME_XOR);
 	}
 	else
 	{
-		return 0;
+		busPutChar(value);
 	}
+	
+	return crc8(crc, value);
 }
+#endif
 
-// This function converts the PSoC cGetChar calls of all ports into a single return.
-char readChar(void)
-{	
-	if(CHILD == PORT_1)
+// This function sends a byte out of the repeaters that drive the routed ports. A repeater with
+// none of its ports routed is left alone.
+void busPutChar(char value)
+{
+	// Make sure everyone is listening.
+	busSettle();
+	
+	if(ROUTE & PAIR_14)
+	{
+		TX_REPEATER_14_PutChar(value);
+	}
+	
+	if(ROUTE & PAIR_23)
 	{
-		return RECEIVE_1_cGetChar();
+		TX_REPEATER_23_PutChar(value);
 	}
-	else if(CHILD == PORT_2)
+	
+#if FEATURE_SNIFFER
+	if(SNIFF)
 	{
-		return RECEIVE_2_cGetChar();
+		sniffByte(SNIFF_TX, value, TIMEOUT);
 	}
-	else if(CHILD == PORT_3)
+#endif
+}
+
+// This function finishes the wait for everyone to load the right configuration after we switch
+// to PC mode. The timer has been running since the switch, so this only waits for whatever is left
+// of it, if anything.
+void busSettle(void)
+{
+	if(SETTLING)
 	{
-		return RECEIVE_3_cGetChar();
+		// Do nothing while we allow everyone to load the right configuration.
+		while(!TIMEOUT){ }
+		
+		// Stop the timer and reset the timeout flag. The sniffer stamps sent bytes with the
+		// timer, so it keeps counting while the sniffer is on.
+		if(!SNIFF)
+		{
+			TX_TIMEOUT_Stop();
+		}
+		
+		TIMEOUT = 0;
+		SETTLING = 0;
 	}
-	else if(CHILD == PORT_4)
+}
+
+// This function waits for the repeaters that drive the routed ports to finish sending.
+void busWait(void)
+{
+	if(ROUTE & PAIR_14)
 	{
-		return RECEIVE_4_cGetChar();
+		while(!(TX_REPEATER_14_bReadTxStatus() & TX_REPEATER_14_TX_COMPLETE));
 	}
-	else
+	
+	if(ROUTE & PAIR_23)
 	{
-		return 0;
+		while(!(TX_REPEATER_23_bReadTxStatus() & TX_REPEATER_23_TX_COMPLETE));
+	}
+}
+
+#if FEATURE_DUAL_WRITE
+// This function sends two-byte writes to two servos at the same address. If the servos are behind
+// different repeaters, the packets go out at the same time, one byte on each repeater in turn.
+// Otherwise they are sent one after the other.
+void dualServoWrite(int id1, char value1_low, char value1_high, int id2, char value2_low, char value2_high, char address)
+{
+	char packet1[9];			// The packet for the servo behind TX_REPEATER_14.
+	char packet2[9];			// The packet for the servo behind TX_REPEATER_23.
+	char port1 = portOf(id1);	// The port that leads to the first servo.
+	char port2 = portOf(id2);	// The port that leads to the second servo.
+	char route1 = 0;			// The port 0 pin that leads to the first servo.
+	char route2 = 0;			// The port 0 pin that leads to the second servo.
+	char tempByte = 0;			// Temporary byte storage.
+	int tempID = 0;				// Temporary ID storage.
+	int i = 0;					// An iterator for looping.
+	
+	// Drop the instruction if an emergency stop came in since this command started.
+	if(ESTOP)
+	{
+		return;
+	}
+	
+	if(port1 && port2)
+	{
+		route1 = 1 << (port1 - '0');
+		route2 = 1 << (port2 - '0');
+	}
+	
+	// If both servos are behind the same repeater, or we don't know where they are, there is
+	// nothing to gain, so send the packets one after the other.
+	if(!(((route1 & PAIR_14) && (route2 & PAIR_23)) || ((route1 & PAIR_23) && (route2 & PAIR_14))))
+	{
+		longServoInstruction(id1,5,WRITE_SERVO,address,value1_low,value1_high);
+		longServoInstruction(id2,5,WRITE_SERVO,address,value2_low,value2_high);
+		
+		return;
+	}
+	
+	// Put the servo behind TX_REPEATER_14 first.
+	if(route2 & PAIR_14)
+	{
+		tempID = id1;				id1 = id2;					id2 = tempID;
+		tempByte = value1_low;		value1_low = value2_low;	value2_low = tempByte;
+		tempByte = value1_high;		value1_high = value2_high;	value2_high = tempByte;
+	}
+	
+	packet1[0] = SERVO_START;	packet2[0] = SERVO_START;	// Start byte one
+	packet1[1] = SERVO_START;	packet2[1] = SERVO_START;	// Start byte two
+	packet1[2] = wireID(id1);	packet2[2] = wireID(id2);	// The servo ID
+	packet1[3] = 5;				packet2[3] = 5;				// Remaining packet length
+	packet1[4] = WRITE_SERVO;	packet2[4] = WRITE_SERVO;	// Servo instruction
+	packet1[5] = address;		packet2[5] = address;		// Target memory address on the servo EEPROM
+	packet1[6] = value1_low;	packet2[6] = value2_low;	// The first write value
+	packet1[7] = value1_high;	packet2[7] = value2_high;	// The second write value
+	
+	// Calculate the checksum values for our servo communication.
+	packet1[8] = 255-((packet1[2] + 5 + WRITE_SERVO + address + value1_low + value1_high)%256);
+	packet2[8] = 255-((packet2[2] + 5 + WRITE_SERVO + address + value2_low + value2_high)%256);
+	
+	// Only transmit out of the two ports that lead to the servos.
+	ROUTE = route1 | route2;
+	PRT0GS = (~PORT_PINS | ROUTE);
+	
+	// Make sure everyone is listening.
+	busSettle();
+	
+	// Feed both repeaters a byte at a time so the packets go out side by side.
+	for(i = 0; i < 9; i++)
+	{
+		TX_REPEATER_14_PutChar(packet1[i]);
+		TX_REPEATER_23_PutChar(packet2[i]);
+		
+#if FEATURE_SNIFFER
+		if(SNIFF)
+		{
+			sniffByte(SNIFF_TX, packet1[i], TIMEOUT);
+			sniffByte(SNIFF_TX, packet2[i], TIMEOUT);
+		}
+#endif
+	}
+	
+	// Wait for the transmission to finish.
+	busWait();
+	
+	// Make completely sure we're done.
+	xmitWait();
+}
+#endif
+
+#if FEATURE_GROUPS
+// This function sends the same write to every servo in a group with one sync write packet, which
+// every servo hears and picks its own part out of. The packet only goes out of the ports that
+// lead to the group. Count is the number of bytes written to each servo, 1 or 2.
+void groupWrite(char group, char address, char count, char value1, char value2)
+{
+	char members = 0;	// The number of servos in the group.
+	char route = 0;		// The port 0 pins that lead to the group.
+	char port = 0;		// The port that leads to a member.
+	char checksum = 0;	// The running total for the checksum.
+	int i = 0;			// An iterator for looping.
+	
+	// Drop the instruction if an emergency stop came in since this command started.
+	if(ESTOP)
+	{
+		return;
+	}
+	
+	// Count the members and find the ports that lead to them.
+	for(i = 1; i <= TABLE_MODULES; i++)
+	{
+		if(GROUP[group][(i-1)/8] & (1 << ((i-1)%8)))
+		{
+			members++;
+			
+			if(port = portOf(i))
+			{
+				route |= 1 << (port - '0');
+			}
+			else
+			{
+				route = PORT_PINS;
+			}
+		}
+	}
+	
+	// An empty group has nothing to send.
+	if(!members)
+	{
+		return;
+	}
+	
+	// Only transmit out of the ports that lead to the group.
+	ROUTE = route;
+	
+	if(STATE == PC_MODE)
+	{
+		PRT0GS = (~PORT_PINS | ROUTE);
+	}
+	
+	// The checksum covers everything after the start bytes.
+	checksum = BROADCAST + ((count+1)*members + 4) + SYNC_WRITE_SERVO + address + count;
+	
+	// Talk to the servos.
+	busPutChar(SERVO_START);					// Start byte one
+	busPutChar(SERVO_START);					// Start byte two
+	busPutChar(BROADCAST);						// Every servo listens to a sync write
+	busPutChar((count+1)*members + 4);			// Remaining packet length
+	busPutChar(SYNC_WRITE_SERVO);				// Servo instruction
+	busPutChar(address);						// Target memory address on the servo EEPROM
+	busPutChar(count);							// The number of bytes written to each servo
+	
+	for(i = 1; i <= TABLE_MODULES; i++)
+	{
+		if(GROUP[group][(i-1)/8] & (1 << ((i-1)%8)))
+		{
+			busPutChar(i);						// The servo ID
+			busPutChar(value1);					// The first write value
+			checksum += i + value1;
+			
+			if(count > 1)
+			{
+				busPutChar(value2);				// The second write value
+				checksum += value2;
+			}
+		}
+	}
+	
+	busPutChar(255-checksum);					// This is the end of this transmission
+	
+	// Wait for the transmission to finish.
+	busWait();
+	
+	// Make completely sure we're done.
+	xmitWait();
+}
+#endif
+
+#if FEATURE_SNIFFER
+// This function adds a byte to the capture log. Received bytes are stamped with the ms since the
+// receive window opened that the receive interrupt took as the byte came in. Since a window opens
+// right after the last byte goes out, those stamps are the turnaround time and inter-byte gaps.
+// Transmitted bytes are stamped with the ms since the modules finished switching to listen, which
+// busSettle leaves the timer counting while the sniffer is on. Both are in whole ms.
+void sniffByte(char tag, char value, char time)
+{
+	if(SNIFF_COUNT < SNIFF_BUFFER_SIZE)
+	{
+		SNIFF_LOG[SNIFF_COUNT][0] = tag;
+		SNIFF_LOG[SNIFF_COUNT][1] = time;
+		SNIFF_LOG[SNIFF_COUNT][2] = value;
+		SNIFF_COUNT++;
+	}
+	else if(SNIFF_LOST < 255)
+	{
+		// Keep track of how much we missed so the PC knows the log has a hole in it.
+		SNIFF_LOST++;
+	}
+}
+
+// This function adds the bytes still in the receive ring that the sniffer hasn't seen to the
+// capture log, without taking them off of the ring. It must only be called while the receive
+// interrupts are off.
+void sniffRing(void)
+{
+	while(RING_SNIFF != RING_HEAD)
+	{
+		sniffByte(RING_PORT[RING_SNIFF] - '0', RING_DATA[RING_SNIFF], RING_TIME[RING_SNIFF]);
+		RING_SNIFF = (RING_SNIFF + 1) & RING_MASK;
+	}
+}
+
+// This function sends the capture log to the PC as one frame and empties it. The frame is the
+// SNIFF_FRAME byte, the number of entries, the number of entries lost, the number of received
+// bytes lost to a full receive ring, and then three bytes per entry: the tag (SNIFF_TX for sent
+// bytes, or the port number), ms, and the byte itself. It must only be called while the PC
+// configuration is loaded.
+void sniffFlush(void)
+{
+	int i = 0;	// An iterator for looping.
+	
+	COMP_SERIAL_PutChar(SNIFF_FRAME);
+	COMP_SERIAL_PutChar(SNIFF_COUNT);
+	COMP_SERIAL_PutChar(SNIFF_LOST);
+	COMP_SERIAL_PutChar(RING_LOST);
+	
+	for(i = 0; i < SNIFF_COUNT; i++)
+	{
+		COMP_SERIAL_PutChar(SNIFF_LOG[i][0]);
+		COMP_SERIAL_PutChar(SNIFF_LOG[i][1]);
+		COMP_SERIAL_PutChar(SNIFF_LOG[i][2]);
+	}
+	
+	SNIFF_COUNT = 0;
+	SNIFF_LOST = 0;
+	RING_LOST = 0;
+}
+#endif
+
+#if FEATURE_BRIDGE
+// This function passes raw servo packets between the PC and the servo bus. Each packet from the
+// PC is tracked through its servo header so that we can turn the line around as soon as its last
+// byte leaves, rather than waiting for the PC to go quiet. The reply is held here while the PC
+// configuration is unloaded and is forwarded as soon as it is complete or the window runs out.
+// The PC leaves bridge mode by sending BRIDGE_ESCAPE_COUNT escape bytes between packets. Escape
+// bytes between packets are held back until the run either finishes the sequence or is broken, so
+// the exit sequence never reaches the servos.
+void bridgeMode(void)
+{
+	char reply[BRIDGE_BUFFER_SIZE];	// Stores a servo reply while the PC link is unloaded.
+	int tempByte = 0;				// Temporary storage for a byte and its port status.
+	int escapes = 0;				// The number of consecutive escape bytes received.
+	int header = 0;					// The number of header bytes seen in the current packet.
+	int remaining = 0;				// The number of bytes left in the current packet.
+	char target = 0;				// The servo ID the current packet is addressed to.
+	int count = 0;					// The number of reply bytes stored.
+	int i = 0;						// An iterator for looping.
+	
+	// Let the PC know that the bridge is open.
+	COMP_SERIAL_PutChar('B');
+	COMP_SERIAL_PutChar('\n');
+	
+	// Keep the command buffer from filtering the raw bytes.
+	COMP_SERIAL_IntCntl(COMP_SERIAL_DISABLE_RX_INT);
+	
+	// The servo ID isn't known until the third byte, so send on every port.
+	routeTo(0);
+	
+	while(escapes < BRIDGE_ESCAPE_COUNT)
+	{
+		tempByte = COMP_SERIAL_iReadChar();
+		
+		// If the PC sent us a good byte...
+		if(!(tempByte & 0xFF00))
+		{
+			// Hold on to escape bytes between packets, since they may be the exit sequence.
+			if((header < 2) && (tempByte == BRIDGE_ESCAPE))
+			{
+				header = 0;
+				escapes++;
+				
+				continue;
+			}
+			
+			// The run was broken, so the held escape bytes were meant for the bus after all.
+			for(; escapes; escapes--)
+			{
+				busPutChar(BRIDGE_ESCAPE);
+			}
+			
+			// Everything else goes out on the bus untouched.
+			busPutChar(tempByte);
+			
+			if(header < 2)
+			{
+				// Look for the two start bytes.
+				if(tempByte == SERVO_START)
+				{
+					header++;
+				}
+				else
+				{
+					header = 0;
+				}
+			}
+			else if(header == 2)
+			{
+				// This is the servo ID.
+				target = tempByte;
+				header++;
+			}
+			else if(header == 3)
+			{
+				// This is the number of bytes left in the packet. Every packet has at least an
+				// instruction and a checksum, so anything less isn't a packet, and we go back to
+				// looking for start bytes.
+				remaining = tempByte;
+				header = (remaining < 2) ? 0 : 4;
+			}
+			else if(!(--remaining))
+			{
+				// The packet is complete, so wait for the transmission to finish.
+				busWait();
+				
+				// Make completely sure we're done.
+				xmitWait();
+				
+				// Broadcast packets never get a reply.
+				if(target != BROADCAST)
+				{
+					// Listen on the port that leads to the servo, or on every port if we don't
+					// know where it is, and let every byte through.
+					selectModule(target);
+					
+					if(!portOf(target))
+					{
+						CHILD = 0;
+					}
+					
+					configToggle(RX_MODE);
+					filterPorts(0);
+					
+					count = 0;
+					header = 0;
+					
+					// Store the reply until it is complete or we time out.
+					while(TIMEOUT < RX_WINDOW)
+					{
+						tempByte = iReadByte();
+						
+						if((!(tempByte & 0xFF00)) && (count < BRIDGE_BUFFER_SIZE))
+						{
+							reply[count] = tempByte;
+							count++;
+							
+							if(header < 2)
+							{
+								// Throw away anything in front of the start bytes.
+								if(tempByte == SERVO_START)
+								{
+									header++;
+								}
+								else
+								{
+									header = 0;
+									count = 0;
+								}
+							}
+							else if(header == 2)
+							{
+								header++;
+							}
+							else if(header == 3)
+							{
+								remaining = tempByte;
+								header++;
+							}
+							else if(!(--remaining))
+							{
+								// Force a timeout to exit the loop.
+								TIMEOUT = RX_WINDOW;
+							}
+						}
+					}
+					
+					// Switch back to the PC and keep the command buffer out of the way.
+					configToggle(PC_MODE);
+					COMP_SERIAL_IntCntl(COMP_SERIAL_DISABLE_RX_INT);
+					routeTo(0);
+					
+					// Forward whatever we heard.
+					for(i = 0; i < count; i++)
+					{
+						COMP_SERIAL_PutChar(reply[i]);
+					}
+				}
+				
+				header = 0;
+			}
+		}
 	}
+	
+	// Hand the PC link back to the command buffer.
+	COMP_SERIAL_IntCntl(COMP_SERIAL_ENABLE_RX_INT);
 }
+#endif
 
 void xmitWait(void)
 {
@@ -1001,11 +4549,116 @@ void xmitWait(void)
 	}
 }
 
+// This function shuts off the torque of every servo with one broadcast write. It is called from
+// the PC receive interrupt, so it only ever runs while the repeaters are loaded. Whatever packet
+// was on its way out is cut short, and every wait loop in progress is forced to time out. Since
+// the write can land in the middle of that packet, the main loop sends it again before the stop
+// is acknowledged.
+void emergencyStop(void)
+{
+	char route = ROUTE;				// The route of whatever transaction we interrupted.
+	char framed = FRAMED;			// The framing of whatever transaction we interrupted.
+	char route_caps = ROUTE_CAPS;	// The features of the ports it was going to.
+	
+	// The settle timer can't interrupt us in here, so don't wait for it. The host repeats the stop
+	// until it is acknowledged, so a module that was still switching will hear a later one.
+	if(SETTLING)
+	{
+		TX_TIMEOUT_Stop();
+		SETTLING = 0;
+	}
+	
+	// Let the broadcast through on every port and hold off any further servo instructions.
+	ESTOP = 0;
+	servoInstruction(BROADCAST,4,WRITE_SERVO,24,0);
+	ESTOP = 1;
+	
+	// Put the route back the way we found it.
+	ROUTE = route;
+	FRAMED = framed;
+	ROUTE_CAPS = route_caps;
+	PRT0GS = (~PORT_PINS | ROUTE);
+	
+	// Force a timeout to exit all loops.
+	TIMEOUT = RX_WINDOW;
+}
+
+// This interrupt replaces the COMP_SERIAL command buffer routine so that an emergency stop is seen
+// as soon as it arrives, no matter what the main loop is doing. All other bytes are buffered the
+// same way the user module does it, so the COMP_SERIAL command functions still work.
+void PC_RX_ISR(void)
+{
+	char status = COMP_SERIAL_RX_CONTROL_REG;	// The receiver status, read once to clear it.
+	char tempByte = 0;							// Temporary byte storage.
+	
+	// If there is really a byte waiting...
+	if(status & COMP_SERIAL_RX_REG_FULL)
+	{
+		tempByte = COMP_SERIAL_RX_BUFFER_REG;
+		
+		if(status & COMP_SERIAL_RX_ERROR)
+		{
+			// Record the error and reset the receiver after a framing error.
+			COMP_SERIAL_fStatus |= (status & COMP_SERIAL_RX_ERROR);
+			
+			if(status & COMP_SERIAL_RX_FRAMING_ERROR)
+			{
+				COMP_SERIAL_RX_CONTROL_REG &= ~PC_RX_ENABLE;
+				COMP_SERIAL_RX_CONTROL_REG |= PC_RX_ENABLE;
+			}
+		}
+		else if(tempByte == ESTOP_BYTE)
+		{
+			emergencyStop();
+		}
+		else if(!(COMP_SERIAL_fStatus & COMP_SERIAL_RX_BUF_CMDTERM))
+		{
+			if(tempByte == PC_CMD_TERM)
+			{
+				// Terminate the command and flag it as ready.
+				COMP_SERIAL_aRxBuffer[COMP_SERIAL_bRxCnt] = 0;
+				COMP_SERIAL_fStatus |= COMP_SERIAL_RX_BUF_CMDTERM;
+			}
+			else if(tempByte >= PC_IGNORE_BELOW)
+			{
+				if(COMP_SERIAL_bRxCnt < (PC_BUFFER_SIZE - 1))
+				{
+					COMP_SERIAL_aRxBuffer[COMP_SERIAL_bRxCnt] = tempByte;
+					COMP_SERIAL_bRxCnt++;
+				}
+				else
+				{
+					COMP_SERIAL_aRxBuffer[COMP_SERIAL_bRxCnt] = 0;
+					COMP_SERIAL_fStatus |= COMP_SERIAL_RX_BUF_OVERRUN;
+				}
+			}
+		}
+	}
+}
+
 void TX_TIMEOUT_ISR(void)
 {	
 	// Increment the number of timeouts.
 	TIMEOUT++;
 	
+	// Count the time towards the background work, without running past where it is due.
+	if(IDLE_COUNT < PROBE_INTERVAL)
+	{
+		IDLE_COUNT++;
+	}
+	
+#if FEATURE_EVENTS
+	if(EVENT_IDLE < EVENT_INTERVAL)
+	{
+		EVENT_IDLE++;
+	}
+	
+#endif
+	if(STEP_IDLE < DISCOVER_GAP)
+	{
+		STEP_IDLE++;
+	}
+	
 	M8C_ClearIntFlag(INT_CLR0,TX_TIMEOUT_INT_MASK);
 }
 
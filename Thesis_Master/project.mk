@@ -10,7 +10,7 @@ ASMSRCS=
 LIBASMSRCS= comp_serial.asm comp_serialint.asm comp_serialplus.asm psocconfig.asm psocconfigtbl.asm psocdynamic.asm psocdynamicint.asm receive_1.asm receive_1int.asm receive_1plus.asm receive_2.asm receive_2int.asm receive_2plus.asm receive_3.asm receive_3int.asm receive_3plus.asm receive_4.asm receive_4int.asm receive_4plus.asm rx_timeout.asm rx_timeoutint.asm tx_repeater_14.asm tx_repeater_14int.asm tx_repeater_14plus.asm tx_repeater_23.asm tx_repeater_23int.asm tx_repeater_23plus.asm tx_timeout.asm tx_timeoutint.asm
 OBJECT_SOURCES= main.c
 FILLVALUE=0x30
-LASTROM=0x3fff
+LASTROM=0x3fbf
 LASTRAM=0x3ff
 LAST_DATARAM=0x2ff
 CODECOMPRESSOR=